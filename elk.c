@@ -37,8 +37,76 @@
 #define JS_GC_THRESHOLD 0.75
 #endif
 
+#ifndef JS_COMPILE
+#define JS_COMPILE 0  // Compile snippets into token streams, see js_compile()
+#endif
+
+#ifndef JS_ATOMS
+#define JS_ATOMS 0  // Intern property names, see js_intern()
+#endif
+
+#ifndef JS_INDEX
+#define JS_INDEX 0  // Hash properties of large objects, see mkidx()
+#endif
+
+#ifndef JS_ICACHE
+#define JS_ICACHE 0  // Cache variable and property lookups, see icfind()
+#endif
+
+#ifndef JS_INCGC
+#define JS_INCGC 0  // Incremental GC work per statement, bytes. See js_gcslice()
+#endif
+
+#ifndef JS_NURSERY
+#define JS_NURSERY 0  // Nursery size in bytes, see js_minor_gc()
+#endif
+
+#ifndef JS_ROPE
+#define JS_ROPE 0  // Concatenate long strings lazily, see mkrope()
+#endif
+
+#ifndef JS_SHORTSTR
+#define JS_SHORTSTR 0  // Keep strings of up to 5 bytes in jsval_t, see mksstr()
+#endif
+
+#ifndef JS_DTOA
+#define JS_DTOA 0  // Format numbers without snprintf(), see fmtnum()
+#endif
+
+#ifndef JS_ARRAY
+#define JS_ARRAY 0  // Dense arrays, see mkarr()
+#endif
+
+#ifndef JS_TYPED
+#define JS_TYPED 0  // Typed arrays over JS or host memory, see js_mktyped()
+#endif
+
+#ifndef JS_EXTSTR
+#define JS_EXTSTR 0  // Strings in host memory, see js_mkstr_ext()
+#endif
+
+#ifndef JS_CODEREGS
+#define JS_CODEREGS 0  // Max number of code regions, up to 8. See js_addcode()
+#endif
+
+#ifndef JS_MAP
+#define JS_MAP 0  // Map and Set, see mkmap()
+#endif
+
+#ifndef JS_PINS
+#define JS_PINS 0  // GC-safe handles for C code, see js_pin()
+#endif
+
 typedef uint32_t jsoff_t;
 
+// Caller's state, saved on the C stack by callfn() while a function runs.
+// GC treats the saved nogc as a root, and fixes up the saved code and nogc
+struct jscall {
+  struct jscall *prev;  // Outer call, or NULL
+  const char *code;     // Caller's code
+  jsoff_t nogc;         // Caller's nogc
+};
+
 struct js {
   jsoff_t css;        // Max observed C stack size
   jsoff_t lwm;        // JS RAM low watermark: min free RAM observed
@@ -57,6 +125,32 @@ struct js {
   jsoff_t toff;       // Offset of the last parsed token
   jsoff_t tlen;       // Length of the last parsed token
   jsoff_t nogc;       // Entity offset to exclude from GC
+  jsoff_t argf;       // Innermost argument frame offset, or 0
+#if JS_COMPILE
+  jsoff_t tks;        // Offset of the active token stream, or 0
+  jsoff_t tki;        // Index of the next expected token in the stream
+  jsoff_t tkc;        // Token cache: offset of the last cached stream, or 0
+  jsoff_t tkgen;      // Token cache generation, bumped by GC
+#endif
+#if JS_ATOMS
+  jsoff_t atoms;      // Atom table entity offset, or 0
+#endif
+#if JS_ICACHE
+  jsoff_t ics;        // Inline cache entity offset, or 0
+#endif
+#if JS_INCGC
+  jsoff_t gcmap;      // Incremental GC mark bitmap offset, or 0 if idle
+  jsoff_t gcpos;      // Incremental GC walk position
+#endif
+#if JS_NURSERY
+  jsoff_t rset;       // Remembered set entity offset, or 0
+#endif
+#if JS_CODEREGS
+  jsoff_t regs;       // Code region table entity offset, or 0
+#endif
+#if JS_PINS
+  jsoff_t pins;       // Pin table entity offset, or 0
+#endif
   jsval_t tval;       // Holds last parsed numeric or string literal value
   jsval_t scope;      // Current scope
   uint8_t *mem;       // Available JS memory
@@ -65,6 +159,7 @@ struct js {
   jsoff_t gct;        // GC threshold. If brk > gct, trigger GC
   jsoff_t maxcss;     // Maximum allowed C stack size usage
   void *cstk;         // C stack pointer at the beginning of js_eval()
+  struct jscall *cf;  // Innermost function call, or NULL
 };
 
 // A JS memory stores diffenent entities: objects, properties, strings
@@ -84,11 +179,89 @@ struct js {
 // passing params. Each argument is pushed to the top of the memory as jsval_t,
 // and js.size is decreased by sizeof(jsval_t), i.e. 8 bytes. When function
 // returns, js.size is restored back. So js.size is used as a stack pointer.
+//
+// With JS_COMPILE, js_eval() uses the same stack to hold a token stream for
+// the snippet it executes. The snippet is tokenized once, and the parser reads
+// tokens from the stream instead of re-scanning characters - which matters
+// for loops and function bodies, that get parsed again and again:
+//
+//    | code ptr | code len | ntoks | gen | prev | tok0 | tok1 | ... | tokN |
+//        8          4         4      4     4      16     16           16
+//
+// Each token record is: 4 byte toff, 4 byte tlen << 8 | tok, 8 byte tval.
+// Streams for code that lives in JS memory, i.e. function bodies, or in a
+// code region registered by js_addcode(), are not pushed on the stack. They
+// are allocated as string entities instead, and linked into a token cache
+// list via the `prev` field, keyed by code pointer and length. The next call
+// of the same function reuses its stream.
+// JS memory strings never change until GC moves them, and nothing references
+// cached streams, so GC simply drops them all and bumps the generation number.
+//
+// With JS_ATOMS, all property names are interned: properties with equal names
+// share the same key string. An atom table is a string entity that holds an
+// open addressing hash table of key string offsets:
+//
+//    | nslots | count | koff0 | koff1 | ... |
+//
+// Property lookup hashes the name once, and then compares key offsets only.
+// The table does not keep atoms alive: GC rebuilds it from live properties.
+//
+// With JS_INDEX, objects with many properties, like a global scope with lots
+// of imported C functions, get a property index: a hidden property with key
+// offset 0 that always goes first in the property list. Its value is a string
+// entity that holds an open addressing hash table of property offsets:
+//
+//    | nslots | count | poff0 | poff1 | ... |
+//
+// New properties are linked right after the index, and get indexed, too.
+//
+// With JS_ICACHE, variable lookups and `obj.prop` lookups are cached in an
+// inline cache: a string entity with a table of insertion epochs, one per
+// group of property names, and a table of entries, indexed by source position:
+//
+//    | epoch0 | ... | epoch31 | pos | obj | prop | depth | epoch | pos | ... |
+//
+// An entry says that property `prop` of the object `obj` is what the lookup
+// found last time, and `obj` is `depth` scopes up the scope chain. An entry is
+// valid while no properties with the same name group have been added since,
+// i.e. the epoch is unchanged. GC moves entities, thus clears all entries.
+//
+// With JS_ARRAY, an array is a type 3 entity with ARRBIT set, that holds
+// the array length and the offset of a vector: a string entity with
+// contiguous element values. The vector is reallocated twice as big when full:
+//
+//    | ARRBIT | len << 2 | 3 | vector offset |    | cap*8 | val0 | ... |
+//
+// With JS_TYPED, a typed array is a string entity with element type, element
+// count, and a pointer to host memory. If the pointer is NULL, elements are
+// stored in the entity itself, right after the pointer:
+//
+//    | len | type | count | host pointer | elem0 | elem1 | ... |
+//
+// With JS_EXTSTR, an external string is a type 3 entity with both ARRBIT and
+// EXTBIT set, that holds the string length, a pointer to host memory with
+// string bytes, and a function that GC calls to release that memory:
+//
+//    | ARRBIT | EXTBIT | len << 2 | 3 | host pointer | free function |
+//
+// With JS_MAP, Map and Set are laid out like arrays, so GC treats them as
+// arrays. The vector is an open addressing hash table: element count, deleted
+// slot count, and key/value pairs - or just keys, if SETBIT is set:
+//
+//    | ARRBIT | SETBIT | nslots << 2 | 3 | table offset |
+//    | cap*8 | count | deleted | key0 | val0 | key1 | val1 | ... |
+//
+// With JS_PINS, values pinned by C code are kept in a pin table: a string
+// entity with a slot per handle. Pin table is a GC root, and GC fixes up
+// values in it. Handle is a slot index, so it stays valid when GC moves both
+// the table and pinned entities:
+//
+//    | nslots | val0 | val1 | ... |
 
 // clang-format off
 enum { 
   TOK_ERR, TOK_EOF, TOK_IDENTIFIER, TOK_NUMBER, TOK_STRING, TOK_SEMICOLON,
-  TOK_LPAREN, TOK_RPAREN, TOK_LBRACE, TOK_RBRACE,
+  TOK_LPAREN, TOK_RPAREN, TOK_LBRACE, TOK_RBRACE, TOK_LBRACKET, TOK_RBRACKET,
   // Keyword tokens
   TOK_BREAK = 50, TOK_CASE, TOK_CATCH, TOK_CLASS, TOK_CONST, TOK_CONTINUE,
   TOK_DEFAULT, TOK_DELETE, TOK_DO, TOK_ELSE, TOK_FINALLY, TOK_FOR, TOK_FUNC,
@@ -111,13 +284,18 @@ enum {
   // memory layout functions: memory entity types are encoded in the 2 bits,
   // thus type values must be 0,1,2,3
   T_OBJ, T_PROP, T_STR, T_UNDEF, T_NULL, T_NUM, T_BOOL, T_FUNC, T_CODEREF,
-  T_CFUNC, T_ERR
+  T_CFUNC, T_ERR, T_ARR, T_ELEM, T_TYPED, T_TELEM, T_MAP
 };
+#define T_ROPE 3U  // Entity type of a rope. Rope values have T_STR type
+#define ARRBIT 0x40000000U  // Type 3 entity with this bit is an array,
+#define EXTBIT 0x20000000U  // or an external string, if this bit is set too
+#define SETBIT 0x10000000U  // Array entity of a Set, see mkmap()
 
 static const char *typestr(uint8_t t) {
   const char *names[] = { "object", "prop", "string", "undefined", "null",
                           "number", "boolean", "function", "coderef",
-                          "cfunc", "err", "nan" };
+                          "cfunc", "err", "object", "elem", "object",
+                          "elem", "object" };
   return (t < sizeof(names) / sizeof(names[0])) ? names[t] : "??";
 }
 
@@ -157,7 +335,12 @@ static void saveoff(struct js *js, jsoff_t off, jsoff_t val) { memcpy(&js->mem[o
 static void saveval(struct js *js, jsoff_t off, jsval_t val) { memcpy(&js->mem[off], &val, sizeof(val)); }
 static jsoff_t loadoff(struct js *js, jsoff_t off) { jsoff_t v = 0; assert(js->brk <= js->size); memcpy(&v, &js->mem[off], sizeof(v)); return v; }
 static jsoff_t offtolen(jsoff_t off) { return (off >> 2) - 1; }
-static jsoff_t vstrlen(struct js *js, jsval_t v) { return offtolen(loadoff(js, (jsoff_t) vdata(v))); }
+static bool is_sfunc(jsval_t v) { return JS_CODEREGS && vtype(v) == T_FUNC && (vdata(v) >> 47U); }
+static bool is_tfunc(jsval_t v) { return vtype(v) == T_CFUNC && (vdata(v) >> 47U); }
+static bool is_sstr(jsval_t v) { return JS_SHORTSTR && vtype(v) == T_STR && (vdata(v) >> 47U); }
+static jsoff_t sstrlen(jsval_t v) { return (jsoff_t) (vdata(v) >> 40U) & 7U; }
+static bool is_ext(jsoff_t w) { return JS_EXTSTR && (w & (ARRBIT | EXTBIT | 3U)) == (ARRBIT | EXTBIT | 3U); }
+static jsoff_t extlen(jsoff_t w) { return (w >> 2) & 0x7ffffffU; }
 static jsval_t loadval(struct js *js, jsoff_t off) { jsval_t v = 0; memcpy(&v, &js->mem[off], sizeof(v)); return v; }
 static jsval_t upper(struct js *js, jsval_t scope) { return mkval(T_OBJ, loadoff(js, (jsoff_t) (vdata(scope) + sizeof(jsoff_t)))); }
 static jsoff_t align32(jsoff_t v) { return ((v + 3) >> 2) << 2; }
@@ -171,6 +354,16 @@ static size_t tostr(struct js *js, jsval_t value, char *buf, size_t len);
 static jsval_t js_expr(struct js *js);
 static jsval_t js_stmt(struct js *js);
 static jsval_t do_op(struct js *, uint8_t op, jsval_t l, jsval_t r);
+static jsval_t mkstr(struct js *js, const void *ptr, size_t len);
+#if JS_COMPILE
+static void js_tkflush(struct js *js);
+#endif
+#if JS_INCGC
+static void js_wb(struct js *js, jsval_t v);
+#endif
+#if JS_NURSERY
+static void js_remember(struct js *js, jsoff_t off, jsval_t v);
+#endif
 
 static void setlwm(struct js *js) {
   jsoff_t n = 0, css = 0;
@@ -195,6 +388,12 @@ static size_t strobj(struct js *js, jsval_t obj, char *buf, size_t len) {
   jsoff_t next = loadoff(js, (jsoff_t) vdata(obj)) & ~3U;  // First prop offset
   while (next < js->brk && next != 0) {                    // Iterate over props
     jsoff_t koff = loadoff(js, next + (jsoff_t) sizeof(next));
+#if JS_INDEX
+    if (koff == 0) {  // Property index, not a real property
+      next = loadoff(js, next) & ~3U;
+      continue;
+    }
+#endif
     jsval_t val = loadval(js, next + (jsoff_t) (sizeof(next) + sizeof(koff)));
     // printf("PROP %u, koff %u\n", next & ~3, koff);
     n += cpy(buf + n, len - n, ",", n == 1 ? 0 : 1);
@@ -206,11 +405,198 @@ static size_t strobj(struct js *js, jsval_t obj, char *buf, size_t len) {
   return n + cpy(buf + n, len - n, "}", 1);
 }
 
+#if JS_DTOA
+// Shortest round-trip number formatting: Grisu2 algorithm by F. Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers".
+// It finds the shortest decimal within the rounding interval of a double
+// using 64-bit integer math, and a table of normalised powers of ten
+struct fp {
+  uint64_t f;  // Significand
+  int e;       // Binary exponent: value is f * 2^e
+};
+
+static const uint64_t fppow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+                                   10000000, 100000000, 1000000000,
+                                   10000000000ULL, 100000000000ULL,
+                                   1000000000000ULL, 10000000000000ULL,
+                                   100000000000000ULL, 1000000000000000ULL,
+                                   10000000000000000ULL, 100000000000000000ULL,
+                                   1000000000000000000ULL,
+                                   10000000000000000000ULL};
+
+// Significands of 10^k, k = -348, -340, ..., 340. Binary exponents are
+// calculated, see fpcached()
+static const uint64_t fpcache[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL};
+
+static struct fp fpmul(struct fp a, struct fp b) {  // Rounded (a * b) >> 64
+  uint64_t m = 0xffffffffU, ah = a.f >> 32, al = a.f & m, bh = b.f >> 32,
+           bl = b.f & m, t = (al * bl >> 32) + (ah * bl & m) + (al * bh & m);
+  struct fp r = {ah * bh + (ah * bl >> 32) + (al * bh >> 32) +
+                     ((t + (1U << 31)) >> 32),
+                 a.e + b.e + 64};
+  return r;
+}
+
+static struct fp fpnorm(struct fp a) {  // Shift so that the top bit is set
+  while (!(a.f >> 63)) a.f <<= 1, a.e--;
+  return a;
+}
+
+// Return cached 10^-k such that the product with 2^e has exponent -60..-32
+static struct fp fpcached(int e, int *k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int i = ((int) dk + (dk > (int) dk ? 1 : 0)) / 8 + 1, k10 = -348 + i * 8;
+  struct fp r = {fpcache[i], ((k10 * 1741647) >> 19) - 63};
+  *k = -k10;
+  return r;
+}
+
+// Move the last digit closer to the exact value, while staying in range
+static void fpround(char *buf, int n, uint64_t delta, uint64_t rest,
+                    uint64_t tenk, uint64_t wpw) {
+  while (rest < wpw && delta - rest >= tenk &&
+         (rest + tenk < wpw || wpw - rest > rest + tenk - wpw)) {
+    buf[n - 1]--, rest += tenk;
+  }
+}
+
+// Generate shortest digits of `w` within (mp - delta, mp]. Return digit count
+static int fpdigits(struct fp w, struct fp mp, uint64_t delta, char *buf,
+                    int *k) {
+  int n = 0, kappa = 10, sh = -mp.e;
+  uint64_t one = (uint64_t) 1 << sh, wpw = mp.f - w.f, p2 = mp.f & (one - 1);
+  uint32_t p1 = (uint32_t) (mp.f >> sh);
+  while (kappa > 1 && p1 < fppow10[kappa - 1]) kappa--;
+  while (kappa > 0) {  // Integral part
+    uint64_t d = p1 / fppow10[kappa - 1], rest;
+    p1 = (uint32_t) (p1 % fppow10[kappa - 1]);
+    if (d != 0 || n != 0) buf[n++] = (char) ('0' + d);
+    kappa--;
+    if ((rest = ((uint64_t) p1 << sh) + p2) <= delta) {
+      *k += kappa;
+      fpround(buf, n, delta, rest, fppow10[kappa] << sh, wpw);
+      return n;
+    }
+  }
+  for (;;) {  // Fractional part
+    p2 *= 10, delta *= 10;
+    uint64_t d = p2 >> sh;
+    if (d != 0 || n != 0) buf[n++] = (char) ('0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      uint64_t scale = -kappa < 20 ? fppow10[-kappa] : 0;
+      fpround(buf, n, delta, p2, one, wpw * scale);
+      return n;
+    }
+  }
+}
+
+static int fputoa(char *buf, uint64_t v) {  // Print unsigned integer
+  char tmp[20];
+  int i = 0, n = 0;
+  do tmp[n++] = (char) ('0' + v % 10);
+  while ((v /= 10) > 0);
+  while (n > 0) buf[i++] = tmp[--n];
+  return i;
+}
+
+// Print digits `d` of length `n` multiplied by 10^k, like JS does
+static int fpformat(char *buf, const char *d, int n, int k) {
+  int i = 0, kk = n + k;  // Position of the decimal point
+  if (k >= 0 && kk <= 21) {  // 123e2 -> 12300
+    memcpy(buf, d, (size_t) n), memset(buf + n, '0', (size_t) k);
+    return kk;
+  } else if (kk > 0 && kk <= 21) {  // 123e-1 -> 12.3
+    memcpy(buf, d, (size_t) kk), buf[kk] = '.';
+    memcpy(buf + kk + 1, d + kk, (size_t) (n - kk));
+    return n + 1;
+  } else if (kk > -6 && kk <= 0) {  // 123e-5 -> 0.00123
+    buf[0] = '0', buf[1] = '.', memset(buf + 2, '0', (size_t) -kk);
+    memcpy(buf + 2 - kk, d, (size_t) n);
+    return 2 - kk + n;
+  }
+  buf[i++] = d[0];  // 123e30 -> 1.23e+32
+  if (n > 1) buf[i++] = '.', memcpy(buf + i, d + 1, (size_t) n - 1), i += n - 1;
+  buf[i++] = 'e', buf[i++] = kk > 0 ? '+' : '-';
+  return i + fputoa(buf + i, (uint64_t) (kk > 0 ? kk - 1 : 1 - kk));
+}
+
+// Print a number in the shortest form that parses back to the same number.
+// Integers up to 2^53 take a fast path. `buf` must be at least 32 bytes
+static size_t fmtnum(double dv, char *buf) {
+  uint64_t bits, hidden = (uint64_t) 1 << 52;
+  int n = 0, k = 0;
+  char d[20];
+  if (dv < 0) buf[n++] = '-', dv = -dv;
+  if (dv < 9007199254740992.0 && dv == (double) (uint64_t) dv)
+    return (size_t) (n + fputoa(buf + n, (uint64_t) dv));
+  memcpy(&bits, &dv, sizeof(bits));
+  struct fp v = {bits & (hidden - 1), (int) (bits >> 52) - 1075}, m, p, c;
+  if (bits >> 52) {
+    v.f |= hidden;
+  } else {
+    v.e = -1074;  // Subnormal
+  }
+  p.f = (v.f << 1) + 1, p.e = v.e - 1, p = fpnorm(p);  // Upper boundary
+  m.f = v.f == hidden ? (v.f << 2) - 1 : (v.f << 1) - 1;  // Lower boundary
+  m.e = v.f == hidden ? v.e - 2 : v.e - 1;
+  m.f <<= m.e - p.e, m.e = p.e;
+  c = fpcached(p.e, &k);
+  struct fp w = fpmul(fpnorm(v), c), wp = fpmul(p, c), wm = fpmul(m, c);
+  wm.f++, wp.f--;
+  int len = fpdigits(w, wp, wp.f - wm.f, d, &k);
+  return (size_t) (n + fpformat(buf + n, d, len, k));
+}
+#endif
+
 // Stringify numeric JS value
 static size_t strnum(jsval_t value, char *buf, size_t len) {
+#if JS_DTOA
+  char tmp[32];
+  return cpy(buf, len, tmp, fmtnum(tod(value), tmp));
+#else
   double dv = tod(value), iv;
   const char *fmt = modf(dv, &iv) == 0.0 ? "%.17g" : "%g";
   return (size_t) snprintf(buf, len, fmt, dv);
+#endif
+}
+
+// Return length of the JS string
+static jsoff_t vstrlen(struct js *js, jsval_t v) {
+  if (is_sstr(v)) return sstrlen(v);
+  jsoff_t w = loadoff(js, (jsoff_t) vdata(v));
+  return is_ext(w) ? extlen(w) : offtolen(w);
 }
 
 // Return mem offset and length of the JS string
@@ -220,22 +606,273 @@ static jsoff_t vstr(struct js *js, jsval_t value, jsoff_t *len) {
   return (jsoff_t) (off + sizeof(off));
 }
 
+// Short strings live in the jsval_t itself and take no JS memory. A short
+// string has T_STR type and the following 48-bit payload:
+// | 1 | 4 bits unused | 3 bits length | 40 bits: up to 5 string bytes |
+#define SSTR_MAX 5U  // Max length of a short string
+
+static jsval_t mksstr(const void *ptr, size_t len) {
+  uint64_t data = (uint64_t) 1 << 47U | (uint64_t) len << 40U;
+  for (size_t i = 0; i < len; i++)
+    data |= (uint64_t) ((const uint8_t *) ptr)[i] << (i * 8);
+  return mkval(T_STR, data);
+}
+
+// Unpack short string to `buf` of SSTR_MAX + 1 bytes, 0-terminate. Return len
+static jsoff_t sstrget(jsval_t v, char *buf) {
+  jsoff_t i, n = sstrlen(v);
+  for (i = 0; i < n && i < SSTR_MAX; i++) buf[i] = (char) (vdata(v) >> (i * 8));
+  buf[i] = '\0';
+  return i;
+}
+
+// Return bytes and length of a string that is not short
+static const char *strptr(struct js *js, jsval_t v, jsoff_t *len) {
+  jsoff_t off = (jsoff_t) vdata(v), w = loadoff(js, off);
+  if (is_ext(w)) {  // External string, bytes are in host memory
+    const char *p = NULL;
+    memcpy(&p, &js->mem[off + sizeof(off)], sizeof(p));
+    return *len = extlen(w), p;
+  }
+  return (char *) &js->mem[vstr(js, v, len)];
+}
+
+// Return string bytes and length. A short string is unpacked to `buf`
+static const char *vptr(struct js *js, jsval_t v, char *buf, jsoff_t *len) {
+  if (is_sstr(v)) return *len = sstrget(v, buf), buf;
+  return strptr(js, v, len);
+}
+
+#if JS_ROPE
+// Rope is a string concatenation that is not done yet: an entity that holds
+// the total length, and offsets of the left and right parts. The right part
+// is a flat string, the left part can be a rope, too. So a string built by a
+// series of `s += ...` is a chain of ropes, and gets copied once, when it is
+// flattened. A flattened rope keeps the offset of the flat copy in the left
+// part, and 0 in the right part. Layout: | (len + 1) << 2 | 3 | left | right |
+#define ROPE_MIN 32U  // Shorter results of concatenation are flat strings
+
+// Copy first `n` bytes of a string, which can be a rope, to `dst`
+static void strcopy(struct js *js, jsoff_t off, char *dst, jsoff_t n) {
+  jsoff_t end = offtolen(loadoff(js, off));  // End of the current part
+  while ((loadoff(js, off) & 3) == T_ROPE) {
+    jsoff_t r = loadoff(js, off + (jsoff_t) sizeof(off) * 2);
+    off = loadoff(js, off + (jsoff_t) sizeof(off));  // Go to the left part
+    if (r == 0) continue;                            // Flattened
+    jsoff_t rn = offtolen(loadoff(js, r)), pos = end - rn;
+    if (pos < n)
+      memcpy(dst + pos, &js->mem[r + sizeof(r)], n - pos < rn ? n - pos : rn);
+    end = pos;
+  }
+  memcpy(dst, &js->mem[off + sizeof(off)], n < end ? n : end);
+}
+#endif
+
 // Stringify string JS value
 static size_t strstring(struct js *js, jsval_t value, char *buf, size_t len) {
-  jsoff_t slen, off = vstr(js, value, &slen);
+  char tmp[SSTR_MAX + 1];
+  jsoff_t slen;
+  const char *p = vptr(js, value, tmp, &slen);
   size_t n = 0;
   n += cpy(buf + n, len - n, "\"", 1);
-  n += cpy(buf + n, len - n, (char *) &js->mem[off], slen);
+#if JS_ROPE
+  jsoff_t w = is_sstr(value) ? 0 : loadoff(js, (jsoff_t) vdata(value));
+  if ((w & 3) == T_ROPE && !is_ext(w)) {
+    jsoff_t k = len - n < slen ? (jsoff_t) (len - n) : slen;
+    strcopy(js, (jsoff_t) vdata(value), buf + n, k);
+    p = buf + n;  // Rope is copied to the output already
+  }
+#endif
+  n += cpy(buf + n, len - n, p, slen);
   n += cpy(buf + n, len - n, "\"", 1);
   return n;
 }
 
+#if JS_CODEREGS
+// Functions defined in a registered code region reference their source in
+// that region, and take no JS memory. Such function has T_FUNC type and the
+// following 48-bit payload: | 1 | 3 bits region | 22 bits offset | 22 bits len
+// Code region table is a string entity: | ptr0 | len0 | ptr1 | len1 | ... |
+// js_restore() unbinds regions: sets pointers to NULL, and keeps lengths
+#define SFUNC_MAX (1U << 22)  // Max offset and length of a function
+#define REGREC 12U            // Code region record size: 8 byte ptr, 4 byte len
+
+// Return start of the code region `i`, and its length
+static const char *regbase(struct js *js, int i, jsoff_t *len) {
+  const char *p = NULL;
+  jsoff_t rec = js->regs + (jsoff_t) sizeof(rec) + (jsoff_t) i * REGREC;
+  memcpy(&p, &js->mem[rec], sizeof(p));
+  *len = loadoff(js, rec + 8);
+  return p;
+}
+
+// Return index of a code region that holds `n` bytes at `p`, or -1
+static int coderegion(struct js *js, const char *p, size_t n) {
+  for (int i = 0; js->regs != 0 && i < JS_CODEREGS; i++) {
+    jsoff_t len;
+    const char *base = regbase(js, i, &len);
+    if (base == NULL || p < base) continue;
+    if ((size_t) (p - base) + n <= len) return i;
+  }
+  return -1;
+}
+
+// Make a function that references its source, or return 0 if impossible
+static jsval_t mksfunc(struct js *js, const char *p, jsoff_t len) {
+  int i = coderegion(js, p, len);
+  jsoff_t n;
+  if (i < 0 || i > 7 || len >= SFUNC_MAX) return 0;
+  uint64_t off = (uint64_t) (p - regbase(js, i, &n)), r = (uint64_t) i;
+  if (off >= SFUNC_MAX) return 0;
+  return mkval(T_FUNC, (uint64_t) 1 << 47 | r << 44 | off << 22 | len);
+}
+#endif
+
+// Return function source and its length
+static const char *vfunc(struct js *js, jsval_t v, jsoff_t *len) {
+#if JS_CODEREGS
+  if (is_sfunc(v)) {
+    size_t off = (vdata(v) >> 22) & (SFUNC_MAX - 1);
+    jsoff_t n;
+    const char *base = regbase(js, (int) (vdata(v) >> 44) & 7, &n);
+    *len = base == NULL ? 0 : (jsoff_t) (vdata(v) & (SFUNC_MAX - 1));
+    return base == NULL ? "" : base + off;  // Empty if the region is unbound
+  }
+#endif
+  return (char *) &js->mem[vstr(js, v, len)];
+}
+
 // Stringify JS function
 static size_t strfunc(struct js *js, jsval_t value, char *buf, size_t len) {
-  jsoff_t sn, off = vstr(js, value, &sn);
+  jsoff_t sn;
+  const char *p = vfunc(js, value, &sn);
   size_t n = cpy(buf, len, "function", 8);
-  return n + cpy(buf + n, len - n, (char *) &js->mem[off], sn);
+  return n + cpy(buf + n, len - n, p, sn);
+}
+
+#if JS_ARRAY || JS_MAP
+#define ARR_MAX 0x3ffffffU  // Max array length, limited by the header bits
+static jsoff_t arrlen(jsoff_t w) { return (w >> 2) & ARR_MAX; }
+static bool is_arrent(jsoff_t w) {
+  return (w & (ARRBIT | EXTBIT | 3U)) == (ARRBIT | T_ROPE);
+}
+static jsoff_t arrslot(struct js *js, jsoff_t off, jsoff_t i) {
+  return loadoff(js, off + (jsoff_t) sizeof(off)) + (jsoff_t) sizeof(off) +
+         i * (jsoff_t) sizeof(jsval_t);
+}
+#endif
+
+#if JS_ARRAY
+// Stringify JS array
+static size_t strarr(struct js *js, jsval_t value, char *buf, size_t len) {
+  jsoff_t off = (jsoff_t) vdata(value), i, n = arrlen(loadoff(js, off));
+  size_t k = cpy(buf, len, "[", 1);
+  for (i = 0; i < n; i++) {
+    if (i > 0) k += cpy(buf + k, len - k, ",", 1);
+    k += tostr(js, loadval(js, arrslot(js, off, i)), buf + k, len - k);
+  }
+  return k + cpy(buf + k, len - k, "]", 1);
+}
+#endif
+
+#if JS_MAP
+#define MAP_HDR 2U  // Hash table header slots: element count, deleted count
+#define MAP_FREE mkval(T_UNDEF, 0)  // Key of a free slot
+#define MAP_DEL mkval(T_UNDEF, 1)   // Key of a deleted slot
+static jsoff_t mapstride(jsoff_t w) { return w & SETBIT ? 1 : 2; }
+
+// Stringify Map as {key:value,...}, and Set as [key,...]
+static size_t strmap(struct js *js, jsval_t value, char *buf, size_t len) {
+  jsoff_t off = (jsoff_t) vdata(value), w = loadoff(js, off);
+  bool set = w & SETBIT;
+  size_t k = cpy(buf, len, set ? "[" : "{", 1);
+  for (jsoff_t i = MAP_HDR; i < arrlen(w); i += mapstride(w)) {
+    jsval_t key = loadval(js, arrslot(js, off, i));
+    if (vtype(key) == T_UNDEF) continue;  // Free or deleted slot
+    k += cpy(buf + k, len - k, ",", k == 1 ? 0 : 1);
+    k += tostr(js, key, buf + k, len - k);
+    if (set) continue;
+    k += cpy(buf + k, len - k, ":", 1);
+    k += tostr(js, loadval(js, arrslot(js, off, i + 1)), buf + k, len - k);
+  }
+  return k + cpy(buf + k, len - k, set ? "]" : "}", 1);
+}
+#endif
+
+#if JS_TYPED
+#define TA_HDR 16U  // Typed array header: type, count, host pointer
+static const uint8_t tasizes[] = {1, 1, 2, 2, 4, 4, 4, 8};  // By JS_INT8, ...
+static uint8_t tatype(struct js *js, jsoff_t off) {
+  return (uint8_t) loadoff(js, off + 4);
+}
+static jsoff_t talen(struct js *js, jsoff_t off) {
+  return loadoff(js, off + 8);
+}
+
+// Return a pointer to the elements: host memory, or the entity itself
+static uint8_t *taptr(struct js *js, jsoff_t off) {
+  uint8_t *p = NULL;
+  memcpy(&p, &js->mem[off + 12], sizeof(p));
+  return p != NULL ? p : &js->mem[off + sizeof(off) + TA_HDR];
+}
+
+static double taget(struct js *js, jsoff_t off, jsoff_t i) {
+  union { int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32;
+          uint32_t u32; float f32; double f64; } u = {0};
+  uint8_t t = tatype(js, off);
+  memcpy(&u, taptr(js, off) + i * tasizes[t], tasizes[t]);
+  switch (t) {  // clang-format off
+    case JS_INT8:     return u.i8;
+    case JS_UINT8:    return u.u8;
+    case JS_INT16:    return u.i16;
+    case JS_UINT16:   return u.u16;
+    case JS_INT32:    return u.i32;
+    case JS_UINT32:   return u.u32;
+    case JS_FLOAT32:  return (double) u.f32;
+    default:          return u.f64;
+  }  // clang-format on
+}
+
+// Convert a number to an integer modulo 2^32, like ToUint32 in JS. NaN and
+// infinities give 0. Narrower integers take the low bits of the result
+static uint32_t touint32(double d) {
+  double hi;
+  if (!isfinite(d)) return 0;
+  modf(d, &d);  // Truncate. Unlike trunc() and fmod(), modf() needs no libm
+  modf(d / 4294967296.0, &hi);
+  d -= hi * 4294967296.0;  // Exact: a remainder of division by 2^32
+  return (uint32_t) (d < 0 ? d + 4294967296.0 : d);
+}
+
+// Store a number into the element. Integers wrap around, like in JS
+static void taset(struct js *js, jsoff_t off, jsoff_t i, double d) {
+  union { int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32;
+          uint32_t u32; float f32; double f64; } u = {0};
+  uint8_t t = tatype(js, off);
+  switch (t) {  // clang-format off
+    case JS_INT8:     u.i8 = (int8_t) touint32(d); break;
+    case JS_UINT8:    u.u8 = (uint8_t) touint32(d); break;
+    case JS_INT16:    u.i16 = (int16_t) touint32(d); break;
+    case JS_UINT16:   u.u16 = (uint16_t) touint32(d); break;
+    case JS_INT32:    u.i32 = (int32_t) touint32(d); break;
+    case JS_UINT32:   u.u32 = touint32(d); break;
+    case JS_FLOAT32:  u.f32 = (float) d; break;
+    default:          u.f64 = d; break;
+  }  // clang-format on
+  memcpy(taptr(js, off) + i * tasizes[t], &u, tasizes[t]);
+}
+
+// Stringify typed array, like an array
+static size_t strtyped(struct js *js, jsval_t value, char *buf, size_t len) {
+  jsoff_t off = (jsoff_t) vdata(value), i, n = talen(js, off);
+  size_t k = cpy(buf, len, "[", 1);
+  for (i = 0; i < n && k < len; i++) {
+    if (i > 0) k += cpy(buf + k, len - k, ",", 1);
+    k += tostr(js, tov(taget(js, off, i)), buf + k, len - k);
+  }
+  return k + cpy(buf + k, len - k, "]", 1);
 }
+#endif
 
 jsval_t js_mkerr(struct js *js, const char *xx, ...) {
   va_list ap;
@@ -259,6 +896,15 @@ static size_t tostr(struct js *js, jsval_t value, char *buf, size_t len) {
     case T_NUM:   return strnum(value, buf, len);
     case T_FUNC:  return strfunc(js, value, buf, len);
     case T_CFUNC: return (size_t) snprintf(buf, len, "\"c_func_0x%lx\"", (unsigned long) vdata(value));
+#if JS_ARRAY
+    case T_ARR:   return strarr(js, value, buf, len);
+#endif
+#if JS_TYPED
+    case T_TYPED: return strtyped(js, value, buf, len);
+#endif
+#if JS_MAP
+    case T_MAP:   return strmap(js, value, buf, len);
+#endif
     case T_PROP:  return (size_t) snprintf(buf, len, "PROP@%lu", (unsigned long) vdata(value));
     default:      return (size_t) snprintf(buf, len, "VTYPE%d", vtype(value));
   }  // clang-format on
@@ -273,14 +919,16 @@ const char *js_str(struct js *js, jsval_t value) {
   if (is_err(value)) return js->errmsg;
   if (js->brk + sizeof(jsoff_t) >= js->size) return "";
   len = tostr(js, value, buf, available);
-  js_mkstr(js, NULL, len);
+  mkstr(js, NULL, len);
   return buf;
 }
 
 bool js_truthy(struct js *js, jsval_t v) {
   uint8_t t = vtype(v);
   return (t == T_BOOL && vdata(v) != 0) || (t == T_NUM && tod(v) != 0.0) ||
-         (t == T_OBJ || t == T_FUNC) || (t == T_STR && vstrlen(js, v) > 0);
+         (t == T_OBJ || t == T_FUNC || t == T_ARR || t == T_TYPED ||
+          t == T_MAP) ||
+         (t == T_STR && vstrlen(js, v) > 0);
 }
 
 static jsoff_t js_alloc(struct js *js, size_t size) {
@@ -302,162 +950,1347 @@ static jsval_t mkentity(struct js *js, jsoff_t b, const void *buf, size_t len) {
   return mkval(b & 3, ofs);
 }
 
-jsval_t js_mkstr(struct js *js, const void *ptr, size_t len) {
+static jsval_t mkstr(struct js *js, const void *ptr, size_t len) {
   jsoff_t n = (jsoff_t) (len + 1);
   // printf("MKSTR %u %u\n", n, js->brk);
   return mkentity(js, (jsoff_t) ((n << 2) | T_STR), ptr, n);
 }
 
+jsval_t js_mkstr(struct js *js, const void *ptr, size_t len) {
+  if (JS_SHORTSTR && ptr != NULL && len <= SSTR_MAX) return mksstr(ptr, len);
+  return mkstr(js, ptr, len);
+}
+
+// Return a copy of a short or an external string in JS memory. Other values
+// are returned as is
+static jsval_t unshort(struct js *js, jsval_t v) {
+  char buf[SSTR_MAX + 1];
+  jsoff_t n;
+  if (is_sstr(v)) return mkstr(js, buf, sstrget(v, buf));
+  if (vtype(v) != T_STR || !is_ext(loadoff(js, (jsoff_t) vdata(v)))) return v;
+  const char *p = vptr(js, v, buf, &n);
+  jsval_t str = mkstr(js, NULL, n);  // Host bytes are not 0-terminated
+  if (!is_err(str)) memcpy(&js->mem[vdata(str) + sizeof(n)], p, n);
+  return str;
+}
+
 static jsval_t mkobj(struct js *js, jsoff_t parent) {
   return mkentity(js, 0 | T_OBJ, &parent, sizeof(parent));
 }
 
-static jsval_t setprop(struct js *js, jsval_t obj, jsval_t k, jsval_t v) {
-  jsoff_t koff = (jsoff_t) vdata(k);          // Key offset
-  jsoff_t b, head = (jsoff_t) vdata(obj);     // Property list head
-  char buf[sizeof(koff) + sizeof(v)];         // Property memory layout
-  memcpy(&b, &js->mem[head], sizeof(b));      // Load current 1st prop offset
-  memcpy(buf, &koff, sizeof(koff));           // Initialize prop data: copy key
-  memcpy(buf + sizeof(koff), &v, sizeof(v));  // Copy value
-  jsoff_t brk = js->brk | T_OBJ;              // New prop offset
-  memcpy(&js->mem[head], &brk, sizeof(brk));  // Repoint head to the new prop
-  // printf("PROP: %u -> %u\n", b, brk);
-  return mkentity(js, (b & ~3U) | T_PROP, buf, sizeof(buf));  // Create new prop
+#if JS_ROPE
+// Return a flat version of a string: flatten it if it is a rope
+static jsval_t strflat(struct js *js, jsval_t v) {
+  if (is_sstr(v)) return v;
+  jsoff_t off = (jsoff_t) vdata(v), w = loadoff(js, off);
+  if ((w & 3) != T_ROPE || is_ext(w)) return v;
+  if (loadoff(js, off + (jsoff_t) sizeof(off) * 2) != 0) {  // Not flat yet
+    jsval_t str = mkstr(js, NULL, offtolen(w));
+    if (is_err(str)) return str;
+    strcopy(js, off, (char *) &js->mem[vdata(str) + sizeof(off)], offtolen(w));
+    saveoff(js, off + (jsoff_t) sizeof(off), (jsoff_t) vdata(str));
+    saveoff(js, off + (jsoff_t) sizeof(off) * 2, 0);
+#if JS_NURSERY
+    js_remember(js, off, str);
+#endif
+  }
+  return mkval(T_STR, loadoff(js, off + (jsoff_t) sizeof(off)));
+}
+
+// Concatenate strings `l` and `r`, with total length `n`, without copying
+// `l`. If the right part of `l` is short, make a new one by appending `r` to
+// it, so that the rope does not grow a node per every small append
+static jsval_t mkrope(struct js *js, jsval_t l, jsval_t r, jsoff_t n) {
+  jsoff_t parts[] = {(jsoff_t) vdata(l), 0}, x = parts[0], lr = 0;
+  if ((loadoff(js, x) & 3) == T_ROPE) lr = loadoff(js, x + sizeof(x) * 2);
+  jsoff_t n1 = lr ? offtolen(loadoff(js, lr)) : 0, n2 = vstrlen(js, r);
+  if (lr != 0 && n1 + n2 < ROPE_MIN) {
+    jsval_t str = mkstr(js, NULL, n1 + n2);
+    if (is_err(str)) return str;
+    char *p = (char *) &js->mem[vdata(str) + sizeof(x)];
+    memcpy(p, &js->mem[lr + sizeof(lr)], n1);
+    if (is_sstr(r)) {
+      sstrget(r, p + n1);
+    } else {
+      strcopy(js, (jsoff_t) vdata(r), p + n1, n2);
+    }
+    parts[0] = loadoff(js, x + sizeof(x)), r = str;
+  } else if (is_err(r = unshort(js, strflat(js, r)))) {  // Flat, in memory
+    return r;
+  }
+  parts[1] = (jsoff_t) vdata(r);
+  jsval_t rope = mkentity(js, ((n + 1) << 2) | T_ROPE, parts, sizeof(parts));
+  return is_err(rope) ? rope : mkval(T_STR, vdata(rope));
+}
+#endif
+
+#if JS_ARRAY
+// Create an empty array. Its vector is allocated on the first push
+static jsval_t mkarr(struct js *js) {
+  jsoff_t vec = 0;
+  jsval_t arr = mkentity(js, ARRBIT | T_ROPE, &vec, sizeof(vec));
+  return is_err(arr) ? arr : mkval(T_ARR, vdata(arr));
+}
+
+// Append a value to the array. Return new array length
+static jsval_t arrpush(struct js *js, jsval_t arr, jsval_t v) {
+  jsoff_t off = (jsoff_t) vdata(arr), w = loadoff(js, off), n = arrlen(w);
+  jsoff_t vec = loadoff(js, off + (jsoff_t) sizeof(off));
+  jsoff_t cap = vec ? offtolen(loadoff(js, vec)) / (jsoff_t) sizeof(v) : 0;
+  if (n >= ARR_MAX) return js_mkerr(js, "array too big");
+  if (n >= cap) {  // Vector is full, reallocate it twice as big
+    jsval_t nv = mkstr(js, NULL, (cap ? cap * 2 : 4) * sizeof(v));
+    if (is_err(nv)) return nv;
+    if (n > 0) {
+      memmove(&js->mem[vdata(nv) + sizeof(off)], &js->mem[vec + sizeof(off)],
+              n * sizeof(v));
+    }
+    saveoff(js, off + (jsoff_t) sizeof(off), (jsoff_t) vdata(nv));
+#if JS_NURSERY
+    js_remember(js, off, nv);
+#endif
+  }
+#if JS_INCGC
+  js_wb(js, v);
+#endif
+#if JS_NURSERY
+  js_remember(js, off, v);
+#endif
+  saveval(js, arrslot(js, off, n), v);
+  saveoff(js, off, (w & ~(ARR_MAX << 2)) | ((n + 1) << 2));
+  return tov((double) (n + 1));
+}
+
+// Remove the last element of the array, and return it
+static jsval_t arrpop(struct js *js, jsval_t arr) {
+  jsoff_t off = (jsoff_t) vdata(arr), w = loadoff(js, off), n = arrlen(w);
+  if (n == 0) return js_mkundef();
+  saveoff(js, off, (w & ~(ARR_MAX << 2)) | ((n - 1) << 2));
+  return loadval(js, arrslot(js, off, n - 1));
 }
+#endif
 
-// Return T_OBJ/T_PROP/T_STR entity size based on the first word in memory
+// Return T_OBJ/T_PROP/T_STR/T_ROPE entity size based on the first word
 static inline jsoff_t esize(jsoff_t w) {
   switch (w & 3U) {  // clang-format off
     case T_OBJ:   return (jsoff_t) (sizeof(jsoff_t) + sizeof(jsoff_t));
     case T_PROP:  return (jsoff_t) (sizeof(jsoff_t) + sizeof(jsoff_t) + sizeof(jsval_t));
     case T_STR:   return (jsoff_t) (sizeof(jsoff_t) + align32(w >> 2U));
+    case T_ROPE:  return (jsoff_t) ((w & EXTBIT) ? 20 : sizeof(jsoff_t) * ((w & ARRBIT) ? 2 : 3));
     default:      return (jsoff_t) ~0U;
   }  // clang-format on
 }
 
-static bool is_mem_entity(uint8_t t) {
-  return t == T_OBJ || t == T_PROP || t == T_STR || t == T_FUNC;
+#if JS_ATOMS || JS_INDEX || JS_ICACHE || JS_MAP
+static uint32_t strhash(const char *p, size_t n) {
+  uint32_t h = 2166136261U;  // FNV-1a
+  for (size_t i = 0; i < n; i++) h = (h ^ (uint8_t) p[i]) * 16777619U;
+  return h;
 }
+#endif
 
-#define GCMASK ~(((jsoff_t) ~0) >> 1)  // Entity deletion marker
-static void js_fixup_offsets(struct js *js, jsoff_t start, jsoff_t size) {
-  for (jsoff_t n, v, off = 0; off < js->brk; off += n) {  // start from 0!
-    v = loadoff(js, off);
-    n = esize(v & ~GCMASK);
-    if (v & GCMASK) continue;  // To be deleted, don't bother
-    if ((v & 3) != T_OBJ && (v & 3) != T_PROP) continue;
-    if (v > start) saveoff(js, off, v - size);
-    if ((v & 3) == T_OBJ) {
-      jsoff_t u = loadoff(js, (jsoff_t) (off + sizeof(jsoff_t)));
-      if (u > start) saveoff(js, (jsoff_t) (off + sizeof(jsoff_t)), u - size);
-    }
-    if ((v & 3) == T_PROP) {
-      jsoff_t koff = loadoff(js, (jsoff_t) (off + sizeof(off)));
-      if (koff > start) saveoff(js, (jsoff_t) (off + sizeof(off)), koff - size);
-      jsval_t val = loadval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)));
-      if (is_mem_entity(vtype(val)) && vdata(val) > start) {
-        saveval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)),
-                mkval(vtype(val), (unsigned long) (vdata(val) - size)));
-      }
-    }
-  }
-  // Fixup js->scope
-  jsoff_t off = (jsoff_t) vdata(js->scope);
-  if (off > start) js->scope = mkval(T_OBJ, off - size);
-  if (js->nogc >= start) js->nogc -= size;
-  // Fixup code that we're executing now, if required
-  if (js->code > (char *) js->mem && js->code - (char *) js->mem < js->size &&
-      js->code - (char *) js->mem > start) {
-    js->code -= size;
-    // printf("GC-ing code under us!! %ld\n", js->code - (char *) js->mem);
+#if JS_ATOMS
+#define ATOMS_MIN 16U  // Initial number of atom table slots
+
+// Return atom table slot offset for the given name: either a slot that holds
+// an atom with that name, or an empty slot where that atom should go
+static jsoff_t atomslot(struct js *js, const char *buf, size_t len) {
+  jsoff_t base = js->atoms + (jsoff_t) sizeof(jsoff_t) * 3;
+  jsoff_t mask = loadoff(js, js->atoms + (jsoff_t) sizeof(jsoff_t)) - 1;
+  for (jsoff_t i = strhash(buf, len) & mask;; i = (i + 1) & mask) {
+    jsoff_t koff = loadoff(js, base + i * (jsoff_t) sizeof(koff));
+    if (koff == 0) return base + i * (jsoff_t) sizeof(koff);
+    if (offtolen(loadoff(js, koff)) == len &&
+        memcmp(&js->mem[koff + sizeof(koff)], buf, len) == 0)
+      return base + i * (jsoff_t) sizeof(koff);
   }
-  // printf("FIXEDOFF %u %u\n", start, size);
 }
 
-static void js_delete_marked_entities(struct js *js) {
-  for (jsoff_t n, v, off = 0; off < js->brk; off += n) {
-    v = loadoff(js, off);
-    n = esize(v & ~GCMASK);
-    if (v & GCMASK) {  // This entity is marked for deletion, remove it
-      // printf("DEL: %4u %d %x\n", off, v & 3, n);
-      // assert(off + n <= js->brk);
-      js_fixup_offsets(js, off, n);
-      memmove(&js->mem[off], &js->mem[off + n], js->brk - off - n);
-      js->brk -= n;  // Shrink brk boundary by the size of deleted entity
-      n = 0;         // We shifted data, next iteration stay on this offset
-    }
-  }
+// Return atom offset for the given name, or 0 if there is no such atom
+static jsoff_t atomfind(struct js *js, const char *buf, size_t len) {
+  return loadoff(js, atomslot(js, buf, len));
 }
 
-static void js_mark_all_entities_for_deletion(struct js *js) {
+// Put key string into the atom table. If an atom with that name already
+// exists, return it, otherwise the given key string becomes an atom.
+// Return 0 if the table is full
+static jsoff_t atomput(struct js *js, jsoff_t koff) {
+  jsoff_t n = offtolen(loadoff(js, koff));
+  jsoff_t slot = atomslot(js, (char *) &js->mem[koff + sizeof(koff)], n);
+  jsoff_t atom = loadoff(js, slot), cnt = js->atoms + sizeof(koff) * 2;
+  jsoff_t nslots = loadoff(js, js->atoms + (jsoff_t) sizeof(koff));
+  if (atom != 0) return atom;
+  if ((loadoff(js, cnt) + 1) * 4 > nslots * 3) return 0;
+  saveoff(js, slot, koff);
+  saveoff(js, cnt, loadoff(js, cnt) + 1);
+  return koff;
+}
+
+// Fill atom table from scratch: walk over all properties, intern their keys
+static bool atomfill(struct js *js) {
+  jsoff_t nslots = loadoff(js, js->atoms + (jsoff_t) sizeof(jsoff_t));
+  memset(&js->mem[js->atoms + sizeof(jsoff_t) * 2], 0,
+         (nslots + 1) * sizeof(jsoff_t));
   for (jsoff_t v, off = 0; off < js->brk; off += esize(v)) {
     v = loadoff(js, off);
-    saveoff(js, off, v | GCMASK);
+    if ((v & 3) != T_PROP || loadoff(js, off + sizeof(off)) == 0) continue;
+    jsoff_t ko = off + (jsoff_t) sizeof(off), atom = atomput(js, loadoff(js, ko));
+    if (atom == 0) return false;
+    saveoff(js, ko, atom);  // Dedupe equal keys
   }
+  return true;
 }
 
-static jsoff_t js_unmark_entity(struct js *js, jsoff_t off) {
-  jsoff_t v = loadoff(js, off);
-  if (v & GCMASK) {
-    saveoff(js, off, v & ~GCMASK);
-    // printf("UNMARK %5u %d\n", off, v & 3);
-    if ((v & 3) == T_OBJ) js_unmark_entity(js, v & ~(GCMASK | 3));
-    if ((v & 3) == T_PROP) {
-      js_unmark_entity(js, v & ~(GCMASK | 3));  // Unmark next prop
-      js_unmark_entity(js, loadoff(js, (jsoff_t) (off + sizeof(off))));  // key
-      jsval_t val = loadval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)));
-      if (is_mem_entity(vtype(val))) js_unmark_entity(js, (jsoff_t) vdata(val));
-    }
+// Create a new atom table with at least `nslots` slots. Old table, if any,
+// becomes garbage. On failure, interning is off: js->atoms is 0
+static bool mkatoms(struct js *js, jsoff_t nslots) {
+  for (;; nslots *= 2) {
+    jsval_t t = mkstr(js, NULL, (nslots + 2) * sizeof(nslots));
+    js->atoms = vtype(t) == T_STR ? (jsoff_t) vdata(t) : 0;
+    if (js->atoms == 0) return false;
+    saveoff(js, js->atoms + (jsoff_t) sizeof(nslots), nslots);
+    if (atomfill(js)) return true;
   }
-  return v & ~(GCMASK | 3U);
 }
 
-static void js_unmark_used_entities(struct js *js) {
-  jsval_t scope = js->scope;
-  do {
-    js_unmark_entity(js, (jsoff_t) vdata(scope));
-    scope = upper(js, scope);
-  } while (vdata(scope) != 0);  // When global scope is GC-ed, stop
-  if (js->nogc) js_unmark_entity(js, js->nogc);
-  // printf("UNMARK: nogc %u\n", js->nogc);
-  // js_dump(js);
+// Make sure there is room for one more atom. Create or grow the table
+static bool atomroom(struct js *js) {
+  if (js->atoms == 0) {
+    jsoff_t n = (ATOMS_MIN + 3) * (jsoff_t) sizeof(jsoff_t);
+    if (js->brk + n * 8 > js->size) return false;  // Not worth it
+    return mkatoms(js, ATOMS_MIN);
+  }
+  jsoff_t nslots = loadoff(js, js->atoms + (jsoff_t) sizeof(jsoff_t));
+  jsoff_t count = loadoff(js, js->atoms + (jsoff_t) sizeof(jsoff_t) * 2);
+  if ((count + 1) * 4 <= nslots * 3) return true;
+  return mkatoms(js, nslots * 2);  // If cannot grow, fall back to plain keys
 }
 
-void js_gc(struct js *js) {
-  // printf("================== GC %u\n", js->nogc);
-  setlwm(js);
-  if (js->nogc == (jsoff_t) ~0) return;  // ~0 is a special case: GC Is disabled
-  js_mark_all_entities_for_deletion(js);
-  js_unmark_used_entities(js);
-  js_delete_marked_entities(js);
+// Return interned key string for a given name. Allocate only new names
+static jsval_t js_intern(struct js *js, const char *buf, size_t len) {
+  if (atomroom(js)) {
+    jsoff_t slot = atomslot(js, buf, len), atom = loadoff(js, slot);
+    if (atom != 0) return mkval(T_STR, atom);
+  }
+  jsval_t k = mkstr(js, buf, len);
+  if (js->atoms != 0 && vtype(k) == T_STR) atomput(js, (jsoff_t) vdata(k));
+  return k;
 }
 
-// Skip whitespaces and comments
-static jsoff_t skiptonext(const char *code, jsoff_t len, jsoff_t n) {
-  // printf("SKIP: [%.*s]\n", len - n, &code[n]);
-  while (n < len) {
-    if (is_space(code[n])) {
-      n++;
-    } else if (n + 1 < len && code[n] == '/' && code[n + 1] == '/') {
-      for (n += 2; n < len && code[n] != '\n';) n++;
-    } else if (n + 3 < len && code[n] == '/' && code[n + 1] == '*') {
-      for (n += 4; n < len && (code[n - 2] != '*' || code[n - 1] != '/');) n++;
-    } else {
-      break;
-    }
+// Return interned version of the given key string
+static jsval_t atomize(struct js *js, jsval_t k) {
+  if (vtype(k) != T_STR || !atomroom(js)) return k;
+  return mkval(T_STR, atomput(js, (jsoff_t) vdata(k)));
+}
+#define mkkey(js, buf, len) js_intern((js), (buf), (len))
+#else
+#define mkkey(js, buf, len) mkstr((js), (buf), (len))
+#endif
+
+#if JS_INDEX
+#define INDEX_MIN 16U  // Index objects that have at least that many properties
+
+// Return true if a property at the given offset is a property index
+static bool isidx(struct js *js, jsoff_t off) {
+  return off != 0 && loadoff(js, off + (jsoff_t) sizeof(off)) == 0;
+}
+
+// Return hash table offset of the given property index
+static jsoff_t idxtbl(struct js *js, jsoff_t idx) {
+  return (jsoff_t) vdata(loadval(js, idx + (jsoff_t) sizeof(idx) * 2));
+}
+
+// Return hash table slot offset for the given name: either a slot that holds
+// a property with that name, or an empty slot where that property should go
+static jsoff_t idxslot(struct js *js, jsoff_t tbl, const char *buf, size_t len) {
+  jsoff_t base = tbl + (jsoff_t) sizeof(jsoff_t) * 3;
+  jsoff_t mask = loadoff(js, tbl + (jsoff_t) sizeof(jsoff_t)) - 1;
+  for (jsoff_t i = strhash(buf, len) & mask;; i = (i + 1) & mask) {
+    jsoff_t poff = loadoff(js, base + i * (jsoff_t) sizeof(poff));
+    if (poff == 0) return base + i * (jsoff_t) sizeof(poff);
+    jsoff_t koff = loadoff(js, poff + (jsoff_t) sizeof(poff));
+    if (offtolen(loadoff(js, koff)) == len &&
+        memcmp(&js->mem[koff + sizeof(koff)], buf, len) == 0)
+      return base + i * (jsoff_t) sizeof(poff);
   }
-  return n;
 }
 
-static bool streq(const char *buf, size_t len, const char *p, size_t n) {
-  return n == len && memcmp(buf, p, len) == 0;
+// Put property into the hash table. A property that is already there stays,
+// unless `replace` is set. Return false if the table is full
+static bool idxput(struct js *js, jsoff_t tbl, jsoff_t poff, bool replace) {
+  jsoff_t koff = loadoff(js, poff + (jsoff_t) sizeof(poff));
+  jsoff_t n = offtolen(loadoff(js, koff)), cnt = tbl + sizeof(koff) * 2;
+  jsoff_t slot = idxslot(js, tbl, (char *) &js->mem[koff + sizeof(koff)], n);
+  jsoff_t nslots = loadoff(js, tbl + (jsoff_t) sizeof(koff));
+  if (loadoff(js, slot) != 0) {
+    if (replace) saveoff(js, slot, poff);
+    return true;
+  }
+  if ((loadoff(js, cnt) + 1) * 4 > nslots * 3) return false;
+  saveoff(js, slot, poff);
+  saveoff(js, cnt, loadoff(js, cnt) + 1);
+  return true;
 }
 
-static uint8_t parsekeyword(const char *buf, size_t len) {
+// Allocate a hash table for `n` properties. Return table offset, or 0
+static jsoff_t mkidxtbl(struct js *js, jsoff_t n) {
+  jsoff_t nslots = INDEX_MIN * 2, size;
+  while (nslots < n * 2) nslots *= 2;
+  size = (nslots + 2) * (jsoff_t) sizeof(nslots);
+  if (js->brk + size * 2 > js->size) return 0;  // Not worth it
+  jsoff_t tbl = (jsoff_t) vdata(mkstr(js, NULL, size));
+  saveoff(js, tbl + (jsoff_t) sizeof(tbl), nslots);
+  return tbl;
+}
+
+// Fill property index from scratch. Properties are listed from the newest
+// to the oldest, so the first property with a given name wins
+static void idxfill(struct js *js, jsoff_t idx) {
+  jsoff_t tbl = idxtbl(js, idx), nslots = loadoff(js, tbl + sizeof(tbl));
+  memset(&js->mem[tbl + sizeof(tbl) * 2], 0, (nslots + 1) * sizeof(tbl));
+  for (jsoff_t off = loadoff(js, idx) & ~3U; off != 0;
+       off = loadoff(js, off) & ~3U)
+    idxput(js, tbl, off, false);
+}
+
+// Create property index for the given object. Return false on failure
+static bool mkidx(struct js *js, jsval_t obj) {
+  jsoff_t koff = 0, n = 0, head = (jsoff_t) vdata(obj), tbl;
+  jsoff_t first = loadoff(js, head) & ~3U;
+  if (js->brk + (INDEX_MIN * 2 + 2) * sizeof(n) * 2 > js->size) return false;
+  for (jsoff_t off = first; off != 0; off = loadoff(js, off) & ~3U) n++;
+  if ((tbl = mkidxtbl(js, n)) == 0) return false;  // Leaves room for index
+  jsval_t v = mkval(T_STR, tbl);
+  char buf[sizeof(koff) + sizeof(v)];  // Index is a property with no key
+  memcpy(buf, &koff, sizeof(koff));
+  memcpy(buf + sizeof(koff), &v, sizeof(v));
+  jsoff_t idx = (jsoff_t) vdata(mkentity(js, first | T_PROP, buf, sizeof(buf)));
+  saveoff(js, head, idx | T_OBJ);
+#if JS_INCGC
+  js_wb(js, mkval(T_PROP, first));
+#endif
+#if JS_NURSERY
+  js_remember(js, head, mkval(T_PROP, idx));
+#endif
+  idxfill(js, idx);
+  return true;
+}
+
+// Add a new property, linked right after the index, to the index
+static void idxadd(struct js *js, jsval_t obj, jsoff_t idx, jsoff_t poff) {
+  jsoff_t tbl = idxtbl(js, idx);
+  if (idxput(js, tbl, poff, true)) return;
+  tbl = mkidxtbl(js, loadoff(js, tbl + (jsoff_t) sizeof(tbl) * 2) + 1);
+  if (tbl == 0) {  // Cannot grow. Drop the index, fall back to a plain list
+    saveoff(js, (jsoff_t) vdata(obj), (loadoff(js, idx) & ~3U) | T_OBJ);
+#if JS_NURSERY
+    js_remember(js, (jsoff_t) vdata(obj), mkval(T_PROP, poff));
+#endif
+  } else {
+    saveval(js, idx + (jsoff_t) sizeof(idx) * 2, mkval(T_STR, tbl));
+    idxfill(js, idx);
+#if JS_NURSERY
+    js_remember(js, idx, mkval(T_STR, tbl));
+#endif
+  }
+}
+#endif
+
+#if JS_ICACHE
+#define IC_EPOCHS 32U  // Number of property name groups
+#define IC_SLOTS 64U   // Number of inline cache entries
+#define IC_WORDS 5U    // Entry size: pos, obj, prop, depth, epoch
+
+// Return offset of the insertion epoch for the given property name
+static jsoff_t icepoch(struct js *js, const char *buf, size_t len) {
+  jsoff_t i = strhash(buf, len) & (IC_EPOCHS - 1);
+  return js->ics + (jsoff_t) sizeof(jsoff_t) * (1 + i);
+}
+
+// Return offset of the inline cache set for the given source position.
+// A set holds two entries, the most recently stored one goes first
+static jsoff_t icset(struct js *js, const char *pos) {
+  jsoff_t i = (jsoff_t) ((size_t) pos % (IC_SLOTS / 2));
+  return js->ics + (jsoff_t) sizeof(i) * (1 + IC_EPOCHS + i * IC_WORDS * 2);
+}
+
+// Property has been added, invalidate entries for all names in its group
+static void icbump(struct js *js, jsoff_t koff) {
+  const char *p = (char *) &js->mem[koff + sizeof(koff)];
+  jsoff_t e = icepoch(js, p, offtolen(loadoff(js, koff)));
+  saveoff(js, e, loadoff(js, e) + 1);
+}
+
+// Lookup name `buf`, `len` at the same source position using the inline
+// cache. If `chain` is false, lookup in the object `obj` only, otherwise
+// walk the scope chain starting from `obj`. Return property offset, or 0
+static jsoff_t icfind(struct js *js, const char *buf, size_t len, jsval_t obj,
+                      bool chain) {
+  if (js->ics == 0) return 0;
+  jsoff_t n = sizeof(n), key = (jsoff_t) (size_t) buf, e = icset(js, buf);
+  if (loadoff(js, e) != key) e += n * IC_WORDS;  // Not first, try second
+  jsoff_t prop = loadoff(js, e + n * 2), depth = loadoff(js, e + n * 3);
+  if (loadoff(js, e) != key || prop == 0 || (depth > 0 && !chain)) return 0;
+  if (loadoff(js, e + n * 4) != loadoff(js, icepoch(js, buf, len)))
+    return 0;  // Properties with that name were added, stale entry
+  for (; depth > 0 && vdata(obj) != 0; depth--) obj = upper(js, obj);
+  if (vdata(obj) != loadoff(js, e + n)) return 0;  // Different object/scope
+  jsoff_t koff = loadoff(js, prop + (jsoff_t) sizeof(prop));
+  if (offtolen(loadoff(js, koff)) != len ||
+      memcmp(&js->mem[koff + sizeof(koff)], buf, len) != 0)
+    return 0;  // Another name uses that entry
+  return prop;
+}
+
+// Store lookup result into the inline cache. Create the cache if required
+static void icput(struct js *js, const char *buf, size_t len, jsval_t obj,
+                  jsoff_t prop, jsoff_t depth) {
+  if (js->ics == 0) {
+    jsoff_t n = (1 + IC_EPOCHS + IC_SLOTS * IC_WORDS) * (jsoff_t) sizeof(n);
+    if (js->brk + n * 8 > js->size) return;  // Not worth it
+    js->ics = (jsoff_t) vdata(mkstr(js, NULL, n - sizeof(n)));
+    memset(&js->mem[js->ics + sizeof(n)], 0, n - sizeof(n));
+  }
+  jsoff_t key = (jsoff_t) (size_t) buf, e = icset(js, buf);
+  jsoff_t v[] = {key, (jsoff_t) vdata(obj), prop, depth, 0};
+  v[4] = loadoff(js, icepoch(js, buf, len));
+  if (loadoff(js, e) != key)  // New position, move first entry to second
+    memmove(&js->mem[e + sizeof(v)], &js->mem[e], sizeof(v));
+  memcpy(&js->mem[e], v, sizeof(v));
+}
+
+// Drop all inline cache entries. Epochs can stay
+static void icflush(struct js *js) {
+  jsoff_t n = (jsoff_t) sizeof(n), e = js->ics + n * (1 + IC_EPOCHS);
+  memset(&js->mem[e], 0, IC_SLOTS * IC_WORDS * n);
+}
+#endif
+
+#if JS_MAP
+#define MAP_MIN 8U  // Initial number of hash table slots
+
+// Create an empty Map, or Set. Its table is allocated on the first insert
+static jsval_t mkmap(struct js *js, bool set) {
+  jsoff_t tbl = 0, b = ARRBIT | (set ? SETBIT : 0U) | T_ROPE;
+  jsval_t map = mkentity(js, b, &tbl, sizeof(tbl));
+  return is_err(map) ? map : mkval(T_MAP, vdata(map));
+}
+
+// Return table header value: element count if `i` is 0, or deleted count
+static jsoff_t mapcnt(struct js *js, jsoff_t off, jsoff_t i) {
+  if (loadoff(js, off + (jsoff_t) sizeof(off)) == 0) return 0;
+  return (jsoff_t) tod(loadval(js, arrslot(js, off, i)));
+}
+
+// Check that a value can be a key: a number, or a flat string
+static jsval_t mapkey(struct js *js, jsval_t k) {
+  if (vtype(k) == T_NUM) return tod(k) == 0 ? tov(0) : k;  // -0 is 0
+  if (vtype(k) != T_STR) return js_mkerr(js, "bad key");
+#if JS_ROPE
+  k = strflat(js, k);
+#endif
+  return k;
+}
+
+static uint32_t maphash(struct js *js, jsval_t k) {
+  if (vtype(k) == T_NUM) {
+    uint64_t h = k ^ (k >> 29);
+    return (uint32_t) ((h * 0x9e3779b97f4a7c15ULL) >> 32);
+  }
+  char buf[SSTR_MAX + 1];
+  jsoff_t n;
+  const char *p = vptr(js, k, buf, &n);
+  return strhash(p, n);
+}
+
+static bool mapkeyeq(struct js *js, jsval_t a, jsval_t b) {
+  if (vtype(a) != vtype(b)) return false;
+  if (vtype(a) == T_NUM) return tod(a) == tod(b);
+  char b1[SSTR_MAX + 1], b2[SSTR_MAX + 1];
+  jsoff_t n1, n2;
+  const char *p1 = vptr(js, a, b1, &n1), *p2 = vptr(js, b, b2, &n2);
+  return n1 == n2 && memcmp(p1, p2, n1) == 0;
+}
+
+// Return slot index of the key `k`, or of a slot where it should go: the
+// first deleted slot on the way, or a free one. The probe visits each slot
+// at most once, so if there is no such slot, return 0
+static jsoff_t mapslot(struct js *js, jsoff_t off, jsval_t k) {
+  jsoff_t w = loadoff(js, off), st = mapstride(w), del = 0;
+  jsoff_t mask = (arrlen(w) - MAP_HDR) / st - 1, i = maphash(js, k) & mask;
+  for (jsoff_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    jsoff_t slot = MAP_HDR + i * st;
+    jsval_t key = loadval(js, arrslot(js, off, slot));
+    if (key == MAP_FREE) return del ? del : slot;
+    if (key == MAP_DEL) {
+      if (del == 0) del = slot;
+    } else if (mapkeyeq(js, key, k)) {
+      return slot;
+    }
+  }
+  return del;
+}
+
+// Return slot index of the key `k`, or 0 if there is no such key
+static jsoff_t mapfind(struct js *js, jsoff_t off, jsval_t k) {
+  if (mapcnt(js, off, 0) == 0) return 0;
+  jsoff_t slot = mapslot(js, off, k);
+  if (slot == 0) return 0;
+  return vtype(loadval(js, arrslot(js, off, slot))) == T_UNDEF ? 0 : slot;
+}
+
+// Move all elements into a new table with `cap` slots, dropping deleted ones
+static bool maprehash(struct js *js, jsoff_t off, jsoff_t cap) {
+  jsoff_t w = loadoff(js, off), st = mapstride(w), n = MAP_HDR + cap * st;
+  jsoff_t old = loadoff(js, off + (jsoff_t) sizeof(off)), oldn = arrlen(w);
+  if (n > ARR_MAX) return false;
+  jsval_t tbl = mkstr(js, NULL, n * sizeof(jsval_t));
+  if (is_err(tbl)) return false;
+  jsoff_t cnt = mapcnt(js, off, 0);
+  saveoff(js, off + (jsoff_t) sizeof(off), (jsoff_t) vdata(tbl));
+  saveoff(js, off, (w & ~(ARR_MAX << 2)) | (n << 2));
+  saveval(js, arrslot(js, off, 0), tov(cnt));
+  saveval(js, arrslot(js, off, 1), tov(0));
+  for (jsoff_t i = MAP_HDR; i < n; i++) {
+    saveval(js, arrslot(js, off, i), MAP_FREE);
+  }
+  for (jsoff_t i = MAP_HDR; i < oldn; i += st) {
+    jsoff_t from = old + (jsoff_t) sizeof(old) + i * (jsoff_t) sizeof(jsval_t);
+    jsval_t key = loadval(js, from);
+    if (vtype(key) == T_UNDEF) continue;  // Free or deleted slot
+    jsoff_t to = arrslot(js, off, mapslot(js, off, key));
+    memmove(&js->mem[to], &js->mem[from], st * sizeof(jsval_t));
+  }
+#if JS_NURSERY
+  js_remember(js, off, tbl);
+#endif
+  return true;
+}
+
+// Insert or update an element. For a Set, `v` is ignored
+static jsval_t mapput(struct js *js, jsval_t map, jsval_t k, jsval_t v) {
+  jsoff_t off = (jsoff_t) vdata(map), slot = mapfind(js, off, k);
+  if (slot == 0) {  // New key. Keep the table at most 3/4 full
+    jsoff_t w = loadoff(js, off), cnt = mapcnt(js, off, 0);
+    jsoff_t del = mapcnt(js, off, 1), cap = 0;
+    if (arrlen(w) > 0) cap = (arrlen(w) - MAP_HDR) / mapstride(w);
+    if ((cnt + del + 1) * 4 > cap * 3) {
+      jsoff_t ncap = MAP_MIN;  // Shrinks, if many elements were deleted
+      while ((cnt + 1) * 2 > ncap) ncap *= 2;
+      if (!maprehash(js, off, ncap)) return js_mkerr(js, "oom");
+      del = 0;
+    }
+    slot = mapslot(js, off, k);
+    if (slot == 0) return js_mkerr(js, "map is full");
+    if (loadval(js, arrslot(js, off, slot)) == MAP_DEL) del--;
+    saveval(js, arrslot(js, off, 0), tov(cnt + 1));
+    saveval(js, arrslot(js, off, 1), tov(del));
+#if JS_INCGC
+    js_wb(js, k);
+#endif
+#if JS_NURSERY
+    js_remember(js, off, k);
+#endif
+    saveval(js, arrslot(js, off, slot), k);
+  }
+  if (loadoff(js, off) & SETBIT) return map;
+#if JS_INCGC
+  js_wb(js, v);
+#endif
+#if JS_NURSERY
+  js_remember(js, off, v);
+#endif
+  saveval(js, arrslot(js, off, slot + 1), v);
+  return map;
+}
+
+// Delete an element. Return true if it was there
+static bool mapdel(struct js *js, jsval_t map, jsval_t k) {
+  jsoff_t off = (jsoff_t) vdata(map), slot = mapfind(js, off, k);
+  if (slot == 0) return false;
+  saveval(js, arrslot(js, off, 0), tov(mapcnt(js, off, 0) - 1));
+  saveval(js, arrslot(js, off, 1), tov(mapcnt(js, off, 1) + 1));
+  saveval(js, arrslot(js, off, slot), MAP_DEL);
+  if (!(loadoff(js, off) & SETBIT)) {
+    saveval(js, arrslot(js, off, slot + 1), js_mkundef());  // Let GC take it
+  }
+  return true;
+}
+#endif
+
+static jsval_t setprop(struct js *js, jsval_t obj, jsval_t k, jsval_t v) {
+  if (is_sstr(k)) {  // Property keys live in JS memory
+    char buf[SSTR_MAX + 1];
+    jsoff_t n = sstrget(k, buf);
+    if (is_err(k = mkkey(js, buf, n))) return k;
+  }
+#if JS_ATOMS
+  k = atomize(js, k);  // All property names must be atoms
+#endif
+  jsoff_t koff = (jsoff_t) vdata(k);          // Key offset
+  jsoff_t b, head = (jsoff_t) vdata(obj);     // Property list head
+  char buf[sizeof(koff) + sizeof(v)];         // Property memory layout
+  memcpy(&b, &js->mem[head], sizeof(b));      // Load current 1st prop offset
+#if JS_INDEX
+  jsoff_t idx = isidx(js, b & ~3U) ? b & ~3U : 0;
+  if (idx != 0) head = idx, b = loadoff(js, idx);  // Link after the index
+#endif
+  memcpy(buf, &koff, sizeof(koff));           // Initialize prop data: copy key
+  memcpy(buf + sizeof(koff), &v, sizeof(v));  // Copy value
+  jsoff_t brk = js->brk | (b & 3U);           // New prop offset
+  jsval_t prop = mkentity(js, (b & ~3U) | T_PROP, buf, sizeof(buf));
+  if (vtype(prop) != T_PROP) return prop;     // Out of memory
+  memcpy(&js->mem[head], &brk, sizeof(brk));  // Repoint head to the new prop
+  // printf("PROP: %u -> %u\n", b, brk);
+#if JS_INCGC
+  js_wb(js, mkval(T_PROP, b & ~3U)), js_wb(js, k), js_wb(js, v);
+#endif
+#if JS_NURSERY
+  js_remember(js, head, prop);
+#endif
+#if JS_INDEX
+  if (idx != 0) idxadd(js, obj, idx, (jsoff_t) vdata(prop));
+#endif
+#if JS_ICACHE
+  if (js->ics != 0) icbump(js, koff);
+#endif
+  return prop;
+}
+
+// Unlink property at `prop` from the object, so that GC can take it.
+// Return false if the object does not have that property
+static bool delprop(struct js *js, jsval_t obj, jsoff_t prop) {
+  jsoff_t prev = (jsoff_t) vdata(obj), off = loadoff(js, prev) & ~3U;
+  for (; off != 0 && off != prop; off = loadoff(js, off) & ~3U) prev = off;
+  if (off == 0) return false;
+  jsoff_t w = loadoff(js, prev), next = loadoff(js, prop) & ~3U;
+  saveoff(js, prev, next | (w & 3U));  // Skip the property
+  if (next != 0) {
+#if JS_INCGC
+    js_wb(js, mkval(T_PROP, next));
+#endif
+#if JS_NURSERY
+    js_remember(js, prev, mkval(T_PROP, next));
+#endif
+  }
+#if JS_INDEX
+  jsoff_t idx = loadoff(js, (jsoff_t) vdata(obj)) & ~3U;
+  if (isidx(js, idx)) idxfill(js, idx);  // Rebuild, tables have no tombstones
+#endif
+#if JS_ICACHE
+  if (js->ics != 0) icbump(js, loadoff(js, prop + (jsoff_t) sizeof(prop)));
+#endif
+  return true;
+}
+
+static bool is_mem_entity(jsval_t v) {
+  uint8_t t = vtype(v);
+  if (is_sstr(v) || is_sfunc(v)) return false;
+  return t == T_OBJ || t == T_PROP || t == T_STR || t == T_FUNC ||
+         t == T_ARR || t == T_TYPED || t == T_MAP;
+}
+
+#define GCMASK ~(((jsoff_t) ~0) >> 1)  // Entity deletion marker
+// GC compacts memory by sliding live entities down. Before that, all offsets
+// are forwarded using a break table: a sorted list of dead runs, i.e. runs of
+// adjacent dead entities. Each table entry is 8 bytes: run start offset, and
+// a total size of all runs up to and including this one. The table lives in
+// the free memory. If it does not fit, compaction takes several passes.
+#define GCRUN (sizeof(jsoff_t) * 2)  // Break table entry size
+
+// Return new offset for the offset `off` that points to, or into, a live
+// entity, using a break table of `n` entries
+static jsoff_t js_fwd(const uint8_t *tbl, jsoff_t n, jsoff_t off) {
+  jsoff_t lo = 0, hi = n, e[2];
+  while (lo < hi) {  // Find the number of runs that start below `off`
+    jsoff_t mid = (lo + hi) / 2;
+    memcpy(e, &tbl[mid * GCRUN], sizeof(e));
+    if (e[0] < off) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return off;
+  memcpy(e, &tbl[(lo - 1) * GCRUN], sizeof(e));
+  return off - e[1];
+}
+
+#if JS_INDEX
+// Property index holds property offsets, fix them up, too
+static void idxfixup(struct js *js, jsoff_t tbl, const uint8_t *t, jsoff_t n) {
+  jsoff_t nslots = loadoff(js, tbl + (jsoff_t) sizeof(tbl));
+  for (jsoff_t i = 0; i < nslots; i++) {
+    jsoff_t slot = tbl + (jsoff_t) sizeof(tbl) * (i + 3), poff = loadoff(js, slot);
+    if (poff != 0) saveoff(js, slot, js_fwd(t, n, poff));
+  }
+}
+#endif
+
+// Values that are held while nested expressions are evaluated, e.g. array
+// elements or the lhs of an assignment, go to an argument frame on top of
+// JS memory, below the token streams. Frames are chained, and hold GC roots
+//    | ... | val1 | val0 | prev frame | nvals |
+// A call frame holds the function in val0, and the arguments below it. A JS
+// function call pops its frame when the arguments are bound
+#define ARGHDR 8U  // Argument frame header size
+static jsoff_t argslot(jsoff_t frame, jsoff_t i) {
+  return frame - (i + 1) * (jsoff_t) sizeof(jsval_t);
+}
+static jsoff_t argnvals(struct js *js, jsoff_t frame) {
+  return loadoff(js, frame + (jsoff_t) sizeof(frame));
+}
+
+#if JS_ARRAY || JS_TYPED
+// Array element lvalue holds array offset / 4 and element index
+#define ELEM_MAX (1U << 18)
+static jsoff_t elemarr(jsval_t v) { return (jsoff_t) (vdata(v) << 2); }
+static jsoff_t elemidx(jsval_t v) { return (jsoff_t) (vdata(v) >> 30); }
+#endif
+
+// Return offset of the entity that a frame value refers to, or 0. Frames
+// hold lvalues, too: properties and array elements
+static jsoff_t rootoff(jsval_t v) {
+#if JS_ARRAY || JS_TYPED
+  if (vtype(v) == T_ELEM || vtype(v) == T_TELEM) return elemarr(v);
+#endif
+  return is_mem_entity(v) ? (jsoff_t) vdata(v) : 0;
+}
+
+// Return frame value with the entity offset fixed up
+static jsval_t rootfwd(jsval_t v, const uint8_t *t, jsoff_t n) {
+  jsoff_t off = rootoff(v);
+  if (off == 0) return v;
+  off = js_fwd(t, n, off);
+#if JS_ARRAY || JS_TYPED
+  if (vtype(v) == T_ELEM || vtype(v) == T_TELEM)
+    return mkval(vtype(v), (uint64_t) elemidx(v) << 30 | off >> 2);
+#endif
+  return mkval(vtype(v), off);
+}
+
+// Fix up a pointer to the code that is being executed
+static const char *js_fixup_code(struct js *js, const char *code,
+                                 const uint8_t *t, jsoff_t n) {
+  if (code > (char *) js->mem && code - (char *) js->mem < js->brk) {
+    jsoff_t coff = (jsoff_t) (code - (char *) js->mem);
+    code -= coff - js_fwd(t, n, coff);
+  }
+  return code;
+}
+
+#if JS_PINS
+#define PIN_MIN 8U                  // Initial pin table size
+#define PIN_FREE mkval(T_UNDEF, 1)  // Free pin table slot
+static jsoff_t pincap(struct js *js) {
+  return js->pins == 0 ? 0 : loadoff(js, js->pins + (jsoff_t) sizeof(jsoff_t));
+}
+static jsoff_t pinslot(struct js *js, jsoff_t i) {
+  return js->pins + (jsoff_t) sizeof(i) * 2 + i * (jsoff_t) sizeof(jsval_t);
+}
+#endif
+
+// Fix up offsets held by an object, a property, a rope, or an array
+static void js_fixup_entity(struct js *js, jsoff_t off, const uint8_t *t,
+                            jsoff_t n) {
+  jsoff_t v = loadoff(js, off);
+  if (is_ext(v)) return;  // External string holds no offsets
+#if JS_ARRAY || JS_MAP
+  if (is_arrent(v)) {  // Elements are fixed up in place, then the vector
+    jsoff_t o = off + (jsoff_t) sizeof(off), vec = loadoff(js, o);
+    for (jsoff_t i = 0; i < arrlen(v); i++) {
+      jsoff_t slot = arrslot(js, off, i);
+      jsval_t val = loadval(js, slot);
+      if (!is_mem_entity(val)) continue;
+      saveval(js, slot, mkval(vtype(val), js_fwd(t, n, (jsoff_t) vdata(val))));
+    }
+    if (vec != 0) saveoff(js, o, js_fwd(t, n, vec));
+    return;
+  }
+#endif
+#if JS_ROPE
+  if ((v & 3) == T_ROPE) {
+    for (jsoff_t i = 1; i <= 2; i++) {  // Left and right parts
+      jsoff_t o = off + i * (jsoff_t) sizeof(off), part = loadoff(js, o);
+      if (part != 0) saveoff(js, o, js_fwd(t, n, part));
+    }
+    return;
+  }
+#endif
+  saveoff(js, off, js_fwd(t, n, v & ~3U) | (v & 3U));
+  if ((v & 3) == T_OBJ) {
+    jsoff_t u = loadoff(js, (jsoff_t) (off + sizeof(jsoff_t)));
+    saveoff(js, (jsoff_t) (off + sizeof(jsoff_t)), js_fwd(t, n, u));
+  }
+  if ((v & 3) == T_PROP) {
+    jsoff_t koff = loadoff(js, (jsoff_t) (off + sizeof(off)));
+    saveoff(js, (jsoff_t) (off + sizeof(off)), js_fwd(t, n, koff));
+    jsval_t val = loadval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)));
+#if JS_INDEX
+    if (koff == 0) idxfixup(js, (jsoff_t) vdata(val), t, n);
+#endif
+    if (is_mem_entity(val)) {
+      jsoff_t voff = js_fwd(t, n, (jsoff_t) vdata(val));
+      saveval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)),
+              mkval(vtype(val), voff));
+    }
+  }
+}
+
+// Fix up all offsets. Only entities above `from` can move: below it, only
+// remembered entities can refer to moving entities, see js_minor_gc()
+static void js_fixup_offsets(struct js *js, const uint8_t *t, jsoff_t n,
+                             jsoff_t from) {
+  for (jsoff_t len, v, off = from; off < js->brk; off += len) {
+    v = loadoff(js, off);
+    len = esize(v & ~GCMASK);
+    if (v & GCMASK) continue;  // To be deleted, don't bother
+    if ((v & 3) == T_STR) continue;  // No references inside
+    js_fixup_entity(js, off, t, n);
+  }
+#if JS_NURSERY
+  if (from > 0) {
+    jsoff_t i, cnt = loadoff(js, js->rset + (jsoff_t) sizeof(cnt) * 2);
+    for (i = 0; i < cnt; i++)
+      js_fixup_entity(js, loadoff(js, js->rset + (3 + i) * 4), t, n);
+  }
+  js->rset = js_fwd(t, n, js->rset);
+#endif
+  // Fixup js->scope
+  js->scope = mkval(T_OBJ, js_fwd(t, n, (jsoff_t) vdata(js->scope)));
+  js->nogc = js_fwd(t, n, js->nogc);
+  for (struct jscall *c = js->cf; c != NULL; c = c->prev) {
+    if (c->nogc != 0 && c->nogc != (jsoff_t) ~0)
+      c->nogc = js_fwd(t, n, c->nogc);
+  }
+  for (jsoff_t f = js->argf; f != 0; f = loadoff(js, f)) {
+    for (jsoff_t i = 0; i < argnvals(js, f); i++) {
+      saveval(js, argslot(f, i), rootfwd(loadval(js, argslot(f, i)), t, n));
+    }
+  }
+#if JS_ATOMS
+  if (js->atoms != 0 && from > 0) {  // Full GC refills the table instead
+    jsoff_t i, nslots = loadoff(js, js->atoms + (jsoff_t) sizeof(i));
+    for (i = 0; i < nslots; i++) {
+      jsoff_t slot = js->atoms + (3 + i) * (jsoff_t) sizeof(i);
+      saveoff(js, slot, js_fwd(t, n, loadoff(js, slot)));
+    }
+  }
+  js->atoms = js_fwd(t, n, js->atoms);
+#endif
+#if JS_ICACHE
+  js->ics = js_fwd(t, n, js->ics);
+#endif
+#if JS_CODEREGS
+  js->regs = js_fwd(t, n, js->regs);
+#endif
+#if JS_PINS
+  for (jsoff_t i = 0; i < pincap(js); i++) {
+    jsval_t val = loadval(js, pinslot(js, i));
+    if (!is_mem_entity(val)) continue;
+    saveval(js, pinslot(js, i),
+            mkval(vtype(val), js_fwd(t, n, (jsoff_t) vdata(val))));
+  }
+  js->pins = js_fwd(t, n, js->pins);
+#endif
+  // Fixup code that we're executing now, if required
+  js->code = js_fixup_code(js, js->code, t, n);
+#if JS_COMPILE
+  if (js->tks != 0) {  // Token stream refers to that code, too
+    const char *base;
+    memcpy(&base, &js->mem[js->tks], sizeof(base));
+    base = js_fixup_code(js, base, t, n);
+    memcpy(&js->mem[js->tks], &base, sizeof(base));
+  }
+#endif
+  // And the code of the callers
+  for (struct jscall *c = js->cf; c != NULL; c = c->prev) {
+    c->code = js_fixup_code(js, c->code, t, n);
+  }
+}
+
+// Build a break table for the dead runs above `from`, fix up offsets, and
+// slide live entities down. Return false if there is nothing to delete
+static bool js_compact(struct js *js, jsoff_t from) {
+  jsoff_t one[2], cap = (js->size - js->brk) / (jsoff_t) GCRUN, n = 0;
+  uint8_t *t = cap > 0 ? &js->mem[js->brk] : (uint8_t *) one;
+  jsoff_t len, v, off, end = 0, total = 0;
+  if (cap == 0) cap = 1;  // No free memory: use tiny table on the C stack
+  for (off = from; off < js->brk; off += len) {
+    v = loadoff(js, off);
+    len = esize(v & ~GCMASK);
+    if (!(v & GCMASK)) continue;
+    if (n > 0 && off == end) {  // Adjacent to the previous run: extend it
+      total += len;
+      memcpy(&t[(n - 1) * GCRUN + sizeof(off)], &total, sizeof(total));
+    } else if (n < cap) {  // Start a new run
+      jsoff_t e[2] = {off, total += len};
+      memcpy(&t[n++ * GCRUN], e, sizeof(e));
+    } else {
+      break;  // Table is full. Remaining runs go to the next pass
+    }
+    end = off + len;
+  }
+  if (n == 0) return false;
+  js_fixup_offsets(js, t, n, from);
+  jsoff_t dst = from;
+  for (off = from; off < js->brk; off += len) {  // Slide entities down
+    v = loadoff(js, off);
+    len = esize(v & ~GCMASK);
+    if ((v & GCMASK) && off < end) continue;  // Dead entity in the table
+    if (dst != off) memmove(&js->mem[dst], &js->mem[off], len);
+    dst += len;
+  }
+  js->brk = dst;
+  return true;
+}
+
+static void js_delete_marked_entities(struct js *js, jsoff_t from) {
+  while (js_compact(js, from)) (void) 0;
+}
+
+static void js_mark_all_entities_for_deletion(struct js *js) {
+  for (jsoff_t v, off = 0; off < js->brk; off += esize(v)) {
+    v = loadoff(js, off);
+    saveoff(js, off, v | GCMASK);
+  }
+}
+
+// Unmark entity. Objects and properties refer to other entities, so push
+// them to the mark stack that lives in the free memory at `*sp`. Return
+// false if the stack is full: then the entity stays unmarked, but not scanned
+static bool js_unmark_entity(struct js *js, jsoff_t off, jsoff_t *sp) {
+  jsoff_t v = loadoff(js, off);
+  if (!(v & GCMASK)) return true;  // Already unmarked
+  saveoff(js, off, v & ~GCMASK);
+  // printf("UNMARK %5u %d\n", off, v & 3);
+  if ((v & 3) == T_STR) return true;  // No references inside
+  if (*sp + sizeof(off) > js->size) return false;
+  saveoff(js, *sp, off);
+  *sp += (jsoff_t) sizeof(off);
+  return true;
+}
+
+// Unmark entities referenced by an unmarked object, property, rope or array
+static bool js_unmark_refs(struct js *js, jsoff_t off, jsoff_t *sp) {
+  jsoff_t v = loadoff(js, off);
+  if (is_ext(v)) return true;
+#if JS_ARRAY || JS_MAP
+  if (is_arrent(v)) {
+    jsoff_t vec = loadoff(js, off + (jsoff_t) sizeof(off));
+    bool ok = vec == 0 || js_unmark_entity(js, vec, sp);
+    for (jsoff_t i = 0; i < arrlen(v); i++) {
+      jsval_t val = loadval(js, arrslot(js, off, i));
+      if (is_mem_entity(val))
+        ok &= js_unmark_entity(js, (jsoff_t) vdata(val), sp);
+    }
+    return ok;
+  }
+#endif
+#if JS_ROPE
+  if ((v & 3) == T_ROPE) {
+    jsoff_t l = loadoff(js, off + (jsoff_t) sizeof(off));
+    jsoff_t r = loadoff(js, off + (jsoff_t) sizeof(off) * 2);
+    bool ok = js_unmark_entity(js, l, sp);
+    return r == 0 ? ok : ok & js_unmark_entity(js, r, sp);
+  }
+#endif
+  bool ok = js_unmark_entity(js, v & ~3U, sp);  // First prop, or next prop
+  if ((v & 3) == T_PROP) {
+    ok &= js_unmark_entity(js, loadoff(js, off + (jsoff_t) sizeof(off)), sp);
+    jsval_t val = loadval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)));
+    if (is_mem_entity(val))
+      ok &= js_unmark_entity(js, (jsoff_t) vdata(val), sp);
+  }
+  return ok;
+}
+
+// Unmark entities reachable from GC roots. If `from` is not 0, only entities
+// above it are marked, and remembered entities are roots, too
+static void js_unmark_used_entities(struct js *js, jsoff_t from) {
+  jsoff_t sp = js->brk;
+  bool ok = true;
+  (void) from;  // Used by nursery GC only
+  for (jsval_t scope = js->scope;; scope = upper(js, scope)) {
+    ok &= js_unmark_entity(js, (jsoff_t) vdata(scope), &sp);
+    if (vdata(scope) == 0) break;  // Global scope is the last one
+  }
+  if (js->nogc) ok &= js_unmark_entity(js, js->nogc, &sp);
+  for (struct jscall *c = js->cf; c != NULL; c = c->prev) {
+    if (c->nogc != 0 && c->nogc != (jsoff_t) ~0)
+      ok &= js_unmark_entity(js, c->nogc, &sp);
+  }
+  for (jsoff_t f = js->argf; f != 0; f = loadoff(js, f)) {
+    for (jsoff_t i = 0; i < argnvals(js, f); i++) {
+      jsoff_t off = rootoff(loadval(js, argslot(f, i)));
+      if (off != 0) ok &= js_unmark_entity(js, off, &sp);
+    }
+  }
+#if JS_ATOMS
+  if (js->atoms) ok &= js_unmark_entity(js, js->atoms, &sp);  // Not atoms
+#endif
+#if JS_ICACHE
+  if (js->ics) ok &= js_unmark_entity(js, js->ics, &sp);
+#endif
+#if JS_CODEREGS
+  if (js->regs) ok &= js_unmark_entity(js, js->regs, &sp);
+#endif
+#if JS_PINS
+  if (js->pins) ok &= js_unmark_entity(js, js->pins, &sp);
+  for (jsoff_t i = 0; i < pincap(js); i++) {
+    jsval_t val = loadval(js, pinslot(js, i));
+    if (is_mem_entity(val))
+      ok &= js_unmark_entity(js, (jsoff_t) vdata(val), &sp);
+  }
+#endif
+#if JS_NURSERY
+  if (js->rset) ok &= js_unmark_entity(js, js->rset, &sp);
+  if (from > 0) {
+    jsoff_t i, cnt = loadoff(js, js->rset + (jsoff_t) sizeof(cnt) * 2);
+    for (i = 0; i < cnt; i++)
+      ok &= js_unmark_refs(js, loadoff(js, js->rset + (3 + i) * 4), &sp);
+  }
+#endif
+#if JS_ATOMS
+  if (js->atoms != 0 && from > 0) {  // Young atoms survive until a full GC
+    jsoff_t i, nslots = loadoff(js, js->atoms + (jsoff_t) sizeof(i));
+    for (i = 0; i < nslots; i++) {
+      jsoff_t koff = loadoff(js, js->atoms + (3 + i) * (jsoff_t) sizeof(i));
+      if (koff >= from) ok &= js_unmark_entity(js, koff, &sp);
+    }
+  }
+#endif
+  for (;;) {
+    while (sp > js->brk) {  // Drain the mark stack
+      sp -= (jsoff_t) sizeof(sp);
+      ok &= js_unmark_refs(js, loadoff(js, sp), &sp);
+    }
+    if (ok) break;
+    // Mark stack has overflown. Some unmarked entities are not scanned:
+    // rescan all unmarked entities to find them
+    ok = true;
+    for (jsoff_t v, off = 0; off < js->brk; off += esize(v & ~GCMASK)) {
+      v = loadoff(js, off);
+      if ((v & GCMASK) || (v & 3) == T_STR) continue;
+      ok &= js_unmark_refs(js, off, &sp);
+      while (ok && sp > js->brk) {
+        sp -= (jsoff_t) sizeof(sp);
+        ok &= js_unmark_refs(js, loadoff(js, sp), &sp);
+      }
+    }
+  }
+  // printf("UNMARK: nogc %u\n", js->nogc);
+  // js_dump(js);
+}
+
+#if JS_NURSERY
+// Nursery, or young generation, is the memory above the boundary that the
+// remembered set keeps: entities created after the last GC. Most of them die
+// young, so js_minor_gc() collects only the nursery, and considers all older
+// entities live. It does not walk old entities either: an old entity that
+// gets a reference to a young entity goes to the remembered set, and that
+// set is a GC root. Nursery survivors become old, and old garbage waits for
+// a full js_gc(). Remembered set layout: | young | count | RSET_MAX offsets |
+#define RSET_MAX 32U
+
+// Start a new nursery at brk. Create the remembered set if required
+static void js_nursery(struct js *js) {
+  jsoff_t n = (RSET_MAX + 2) * (jsoff_t) sizeof(n);
+  if (js->rset == 0) {
+    if (js->brk + n * 8 > js->size) return;  // Not worth it
+    js->rset = (jsoff_t) vdata(mkstr(js, NULL, n));
+  }
+  saveoff(js, js->rset + (jsoff_t) sizeof(n), js->brk);
+  saveoff(js, js->rset + (jsoff_t) sizeof(n) * 2, 0);
+}
+
+// Write barrier: entity at `off` gets a reference to `v`. Remember that
+// entity if it is old and `v` is young
+static void js_remember(struct js *js, jsoff_t off, jsval_t v) {
+  jsoff_t i, young, cnt, base = js->rset + (jsoff_t) sizeof(off) * 3;
+  if (js->rset == 0 || !is_mem_entity(v)) return;
+  young = loadoff(js, js->rset + (jsoff_t) sizeof(off));
+  if (off >= young || vdata(v) < young) return;
+  cnt = loadoff(js, js->rset + (jsoff_t) sizeof(off) * 2);
+  for (i = 0; i < cnt && i < RSET_MAX; i++)
+    if (loadoff(js, base + i * (jsoff_t) sizeof(off)) == off) return;
+  if (cnt < RSET_MAX) saveoff(js, base + cnt * (jsoff_t) sizeof(off), off);
+  if (cnt <= RSET_MAX)  // RSET_MAX + 1 means overflow
+    saveoff(js, js->rset + (jsoff_t) sizeof(off) * 2, cnt + 1);
+}
+#endif
+
+#if JS_EXTSTR
+// Release host memory of external strings that are marked for deletion
+static void js_extfree(struct js *js, jsoff_t from) {
+  for (jsoff_t v, off = from; off < js->brk; off += esize(v & ~GCMASK)) {
+    void (*fn)(void *) = NULL;
+    void *p = NULL;
+    v = loadoff(js, off);
+    if (!(v & GCMASK) || !is_ext(v)) continue;
+    memcpy(&p, &js->mem[off + sizeof(off)], sizeof(p));
+    memcpy(&fn, &js->mem[off + sizeof(off) + 8], sizeof(fn));
+    if (fn != NULL) fn(p);
+  }
+}
+#endif
+
+// Delete entities that are left marked when marking is done. If `from` is
+// not 0, entities below it are not marked, and do not move
+static void js_sweep(struct js *js, jsoff_t from) {
+#if JS_COMPILE
+  js_tkflush(js);
+#endif
+#if JS_EXTSTR
+  js_extfree(js, from);
+#endif
+  js_delete_marked_entities(js, from);
+#if JS_ATOMS
+  if (js->atoms && from == 0) atomfill(js);  // Drop dead atoms
+#endif
+#if JS_ICACHE
+  if (js->ics) icflush(js);  // Cached offsets are moved
+#endif
+#if JS_NURSERY
+  js_nursery(js);  // Survivors are old now
+#endif
+}
+
+void js_gc(struct js *js) {
+  // printf("================== GC %u\n", js->nogc);
+  setlwm(js);
+  if (js->nogc == (jsoff_t) ~0) return;  // ~0 is a special case: GC Is disabled
+#if JS_INCGC
+  js->gcmap = 0;  // Abandon incremental GC cycle, if any
+#endif
+  js_mark_all_entities_for_deletion(js);
+  js_unmark_used_entities(js, 0);
+  js_sweep(js, 0);
+}
+
+#if JS_NURSERY
+// Collect the nursery when it is full. Fall back to a full GC if the
+// remembered set has overflown
+static void js_minor_gc(struct js *js) {
+  if (js->nogc == (jsoff_t) ~0) return;  // GC is disabled
+  if (js->rset == 0) {
+    js_nursery(js);  // Start a nursery, if there is room
+    return;
+  }
+#if JS_INCGC
+  if (js->gcmap != 0) return;  // Incremental GC cycle is in progress
+#endif
+  jsoff_t young = loadoff(js, js->rset + (jsoff_t) sizeof(young));
+  if (js->brk - young <= JS_NURSERY) return;
+  if (loadoff(js, js->rset + (jsoff_t) sizeof(young) * 2) > RSET_MAX) {
+    js_gc(js);
+    return;
+  }
+  setlwm(js);
+  for (jsoff_t v, off = young; off < js->brk; off += esize(v)) {
+    v = loadoff(js, off);
+    saveoff(js, off, v | GCMASK);
+  }
+  js_unmark_used_entities(js, young);
+  js_sweep(js, young);
+}
+#endif
+
+#if JS_INCGC
+// Incremental GC spreads marking over statements. A GC cycle starts when brk
+// passes the GC threshold: GC allocates a mark bitmap, one bit per 4 bytes of
+// the memory below the bitmap. Entities above the bitmap are created during
+// the cycle, and are considered reached. Then, every statement walks at most
+// JS_INCGC bytes of memory: each reached object or property marks entities it
+// refers to as reached. When a full walk ends with nothing new to scan, all
+// entities that are not reached get deleted - that step is not incremental,
+// but it is linear, see js_compact(). Storing a reference to an entity during
+// the cycle marks it as reached: see js_wb(). If free memory runs low before
+// the cycle ends, GC falls back to a full js_gc().
+// js->gcpos holds the walk position. GCMASK bit in it means that some reached
+// entities behind the position are not scanned, and the walk must repeat.
+
+// Return true if the entity at the given offset is reached
+static bool js_gclive(struct js *js, jsoff_t off) {
+  if (off >= js->gcmap) return true;  // Created during the cycle
+  return (js->mem[js->gcmap + sizeof(off) + off / 32] >> ((off / 4) & 7)) & 1;
+}
+
+// Mark entity as reached. Objects and properties need scanning: push them
+// to the mark stack at `*sp`. Without the stack, or if it is full, make the
+// walk repeat if it has passed that entity
+static void js_gcreach(struct js *js, jsoff_t off, jsoff_t *sp) {
+  if (js_gclive(js, off)) return;
+  uint8_t *p = &js->mem[js->gcmap + sizeof(off) + off / 32];
+  *p = (uint8_t) (*p | (1 << ((off / 4) & 7)));
+  jsoff_t t = loadoff(js, off) & 3U;
+  if (t == T_STR) return;  // No references inside
+  if (sp != NULL && *sp + sizeof(off) <= js->size) {
+    saveoff(js, *sp, off);
+    *sp += (jsoff_t) sizeof(off);
+  } else if (off < (js->gcpos & ~GCMASK)) {
+    js->gcpos |= GCMASK;
+  }
+}
+
+// Mark entities referenced by a reached object, property, rope or array
+static void js_gcscan(struct js *js, jsoff_t off, jsoff_t *sp) {
+  jsoff_t v = loadoff(js, off);
+  if (is_ext(v)) return;
+#if JS_ARRAY || JS_MAP
+  if (is_arrent(v)) {
+    jsoff_t vec = loadoff(js, off + (jsoff_t) sizeof(off));
+    if (vec != 0) js_gcreach(js, vec, sp);
+    for (jsoff_t i = 0; i < arrlen(v); i++) {
+      jsval_t val = loadval(js, arrslot(js, off, i));
+      if (is_mem_entity(val)) js_gcreach(js, (jsoff_t) vdata(val), sp);
+    }
+    return;
+  }
+#endif
+#if JS_ROPE
+  if ((v & 3) == T_ROPE) {
+    jsoff_t r = loadoff(js, off + (jsoff_t) sizeof(off) * 2);
+    js_gcreach(js, loadoff(js, off + (jsoff_t) sizeof(off)), sp);
+    if (r != 0) js_gcreach(js, r, sp);
+    return;
+  }
+#endif
+  js_gcreach(js, v & ~3U, sp);  // First prop, or next prop
+  if ((v & 3) == T_PROP) {
+    js_gcreach(js, loadoff(js, off + (jsoff_t) sizeof(off)), sp);  // Key
+    jsval_t val = loadval(js, (jsoff_t) (off + sizeof(off) + sizeof(off)));
+    if (is_mem_entity(val)) js_gcreach(js, (jsoff_t) vdata(val), sp);
+  }
+}
+
+// Mark GC roots as reached
+static void js_gcroots(struct js *js) {
+  for (jsval_t scope = js->scope;; scope = upper(js, scope)) {
+    js_gcreach(js, (jsoff_t) vdata(scope), NULL);
+    if (vdata(scope) == 0) break;
+  }
+  if (js->nogc) js_gcreach(js, js->nogc, NULL);
+  for (struct jscall *c = js->cf; c != NULL; c = c->prev) {
+    if (c->nogc != 0 && c->nogc != (jsoff_t) ~0) js_gcreach(js, c->nogc, NULL);
+  }
+  for (jsoff_t f = js->argf; f != 0; f = loadoff(js, f)) {
+    for (jsoff_t i = 0; i < argnvals(js, f); i++) {
+      jsoff_t off = rootoff(loadval(js, argslot(f, i)));
+      if (off != 0) js_gcreach(js, off, NULL);
+    }
+  }
+#if JS_ATOMS
+  if (js->atoms) js_gcreach(js, js->atoms, NULL);
+#endif
+#if JS_ICACHE
+  if (js->ics) js_gcreach(js, js->ics, NULL);
+#endif
+#if JS_CODEREGS
+  if (js->regs) js_gcreach(js, js->regs, NULL);
+#endif
+#if JS_PINS
+  if (js->pins) js_gcreach(js, js->pins, NULL);
+  for (jsoff_t i = 0; i < pincap(js); i++) {
+    jsval_t val = loadval(js, pinslot(js, i));
+    if (is_mem_entity(val)) js_gcreach(js, (jsoff_t) vdata(val), NULL);
+  }
+#endif
+#if JS_NURSERY
+  if (js->rset) js_gcreach(js, js->rset, NULL);
+#endif
+}
+
+// Write barrier: a reference to `v` is being stored
+static void js_wb(struct js *js, jsval_t v) {
+  if (js->gcmap != 0 && is_mem_entity(v))
+    js_gcreach(js, (jsoff_t) vdata(v), NULL);
+}
+
+// Start GC cycle: allocate a mark bitmap. Return false on failure
+static bool js_gcstart(struct js *js) {
+  jsoff_t n = js->brk / 32 + 1;  // Bitmap size
+  if (js->brk + sizeof(n) + n + 1 > js->size) return false;
+  js->gcmap = (jsoff_t) vdata(mkstr(js, NULL, n));
+  memset(&js->mem[js->gcmap + sizeof(n)], 0, n);
+  js->gcpos = 0;
+  js_gcroots(js);
+  return true;
+}
+
+// End GC cycle: delete entities that are not reached, and the bitmap itself
+static void js_gcend(struct js *js) {
+  for (jsoff_t v, off = 0; off <= js->gcmap; off += esize(v)) {
+    v = loadoff(js, off);
+    if (off == js->gcmap || !js_gclive(js, off)) saveoff(js, off, v | GCMASK);
+  }
+  js->gcmap = 0;
+  setlwm(js);
+  js_sweep(js, 0);
+}
+
+// Do a slice of incremental GC work, see JS_INCGC
+static void js_gcslice(struct js *js) {
+  jsoff_t n, v, sp, budget = JS_INCGC, pos;
+  if (js->nogc == (jsoff_t) ~0) return;  // GC is disabled
+  if (js->gcmap == 0 && (js->brk <= js->gct || !js_gcstart(js))) {
+    if (js->brk > js->gct) js_gc(js);  // Cannot start a cycle
+    return;
+  }
+  if (js->size - js->brk < (js->size - js->gct) / 2) {
+    js_gc(js);  // Running out of memory, finish now
+    return;
+  }
+  for (pos = js->gcpos & ~GCMASK; pos < js->brk && budget > 0; pos += n) {
+    v = loadoff(js, pos);
+    n = esize(v);
+    budget = budget > n ? budget - n : 0;
+    if ((v & 3) == T_STR) continue;  // No references inside
+    if (!js_gclive(js, pos)) continue;
+    js->gcpos = (js->gcpos & GCMASK) | pos;
+    sp = js->brk;  // Mark stack
+    js_gcscan(js, pos, &sp);
+    while (sp > js->brk && budget > 0) {  // Scan entities on the mark stack
+      sp -= (jsoff_t) sizeof(sp);
+      js_gcscan(js, loadoff(js, sp), &sp);
+      budget = budget > esize(T_PROP) ? budget - esize(T_PROP) : 0;
+    }
+    if (sp > js->brk) js->gcpos |= GCMASK;  // Out of budget, walk again
+  }
+  js->gcpos = (js->gcpos & GCMASK) | pos;
+  if (pos < js->brk) return;  // Walk is not finished yet
+  if (!(js->gcpos & GCMASK)) js_gcroots(js);  // Roots may have changed
+  if (js->gcpos & GCMASK) {
+    js->gcpos = 0;  // Some entities are not scanned. Walk again
+  } else {
+    js_gcend(js);
+  }
+}
+#endif
+
+// Skip whitespaces and comments
+static jsoff_t skiptonext(const char *code, jsoff_t len, jsoff_t n) {
+  // printf("SKIP: [%.*s]\n", len - n, &code[n]);
+  while (n < len) {
+    if (is_space(code[n])) {
+      n++;
+    } else if (n + 1 < len && code[n] == '/' && code[n + 1] == '/') {
+      for (n += 2; n < len && code[n] != '\n';) n++;
+    } else if (n + 3 < len && code[n] == '/' && code[n + 1] == '*') {
+      for (n += 4; n < len && (code[n - 2] != '*' || code[n - 1] != '/');) n++;
+    } else {
+      break;
+    }
+  }
+  return n;
+}
+
+static bool streq(const char *buf, size_t len, const char *p, size_t n) {
+  return n == len && memcmp(buf, p, len) == 0;
+}
+
+static uint8_t parsekeyword(const char *buf, size_t len) {
   switch (buf[0]) {  // clang-format off
     case 'b': if (streq("break", 5, buf, len)) return TOK_BREAK; break;
     case 'c': if (streq("class", 5, buf, len)) return TOK_CLASS; if (streq("case", 4, buf, len)) return TOK_CASE; if (streq("catch", 5, buf, len)) return TOK_CATCH; if (streq("const", 5, buf, len)) return TOK_CONST; if (streq("continue", 8, buf, len)) return TOK_CONTINUE; break;
-    case 'd': if (streq("do", 2, buf, len)) return TOK_DO;  if (streq("default", 7, buf, len)) return TOK_DEFAULT; break; // if (streq("delete", 6, buf, len)) return TOK_DELETE; break;
+    case 'd': if (streq("do", 2, buf, len)) return TOK_DO;  if (streq("default", 7, buf, len)) return TOK_DEFAULT; if (streq("delete", 6, buf, len)) return TOK_DELETE; break;
     case 'e': if (streq("else", 4, buf, len)) return TOK_ELSE; break;
     case 'f': if (streq("for", 3, buf, len)) return TOK_FOR; if (streq("function", 8, buf, len)) return TOK_FUNC; if (streq("finally", 7, buf, len)) return TOK_FINALLY; if (streq("false", 5, buf, len)) return TOK_FALSE; break;
     case 'i': if (streq("if", 2, buf, len)) return TOK_IF; if (streq("in", 2, buf, len)) return TOK_IN; if (streq("instanceof", 10, buf, len)) return TOK_INSTANCEOF; break;
@@ -482,9 +2315,51 @@ static uint8_t parseident(const char *buf, jsoff_t len, jsoff_t *tlen) {
   return TOK_ERR;
 }
 
+#if JS_COMPILE
+#define TKHDR 24U  // Token stream header size
+#define TKREC 16U  // Token record size
+
+static jsoff_t tkoff(struct js *js, jsoff_t i) {
+  return loadoff(js, js->tks + TKHDR + i * TKREC);
+}
+
+// Fetch next token from the compiled token stream. Return false if the code
+// we're parsing is not covered by the stream, so the lexer must be used
+static bool tknext(struct js *js) {
+  const char *base;
+  memcpy(&base, &js->mem[js->tks], sizeof(base));
+  jsoff_t blen = loadoff(js, js->tks + 8), n = loadoff(js, js->tks + 12);
+  if (js->code < base || js->code + js->clen > base + blen) return false;
+  jsoff_t delta = (jsoff_t) (js->code - base), pos = delta + js->pos,
+          i = js->tki;
+  if (i >= n || tkoff(js, i) < pos || (i > 0 && tkoff(js, i - 1) >= pos)) {
+    jsoff_t lo = 0, hi = n;  // Hint missed, e.g. we've jumped back in a loop
+    while (lo < hi) {        // Binary search 1st token at or after pos
+      jsoff_t mid = lo + (hi - lo) / 2;
+      if (tkoff(js, mid) < pos) lo = mid + 1;
+      else hi = mid;
+    }
+    i = lo;
+  }
+  if (i >= n || tkoff(js, i) >= delta + js->clen) {
+    js->tok = TOK_EOF, js->toff = js->pos = js->clen, js->tlen = 0;
+  } else {
+    jsoff_t rec = js->tks + TKHDR + i * TKREC, v = loadoff(js, rec + 4);
+    js->tok = (uint8_t) (v & 0xffU), js->tlen = v >> 8;
+    js->toff = tkoff(js, i) - delta, js->pos = js->toff + js->tlen;
+    if (js->tok == TOK_NUMBER) js->tval = loadval(js, rec + 8);
+    js->tki = i + 1;
+  }
+  return true;
+}
+#endif
+
 static uint8_t next(struct js *js) {
   if (js->consumed == 0) return js->tok;
   js->consumed = 0;
+#if JS_COMPILE
+  if (js->tks != 0 && tknext(js)) return js->tok;
+#endif
   js->tok = TOK_ERR;
   js->toff = js->pos = skiptonext(js->code, js->clen, js->pos);
   js->tlen = 0;
@@ -500,6 +2375,10 @@ static uint8_t next(struct js *js) {
     case ')': TOK(TOK_RPAREN, 1);
     case '{': TOK(TOK_LBRACE, 1);
     case '}': TOK(TOK_RBRACE, 1);
+#if JS_ARRAY || JS_TYPED
+    case '[': TOK(TOK_LBRACKET, 1);
+    case ']': TOK(TOK_RBRACKET, 1);
+#endif
     case ';': TOK(TOK_SEMICOLON, 1);
     case ',': TOK(TOK_COMMA, 1);
     case '!': if (LOOK(1, '=') && LOOK(2, '=')) TOK(TOK_NE, 3); TOK(TOK_NOT, 1);
@@ -553,6 +2432,73 @@ static inline uint8_t lookahead(struct js *js) {
   return tok;
 }
 
+#if JS_COMPILE
+// Tokenize the whole snippet and push the token stream on top of JS memory.
+// Token records are collected in the free memory first, then moved up.
+// Small snippets, or snippets that do not fit, are left to the lexer
+static void js_compile(struct js *js) {
+  jsoff_t n = 0, top = js->brk > js->gct ? js->brk : js->gct;
+  jsoff_t avail = js->size > top ? (js->size - top) / 2 : 0;
+  js->tks = 0;
+  for (js->consumed = 1; avail >= TKHDR + (n + 1) * TKREC; n++) {
+    jsoff_t rec = js->brk + n * TKREC, v;
+    if (next(js) == TOK_EOF) break;
+    if (js->tok == TOK_ERR) return;  // Leave errors to the lexer
+    v = (jsoff_t) (js->tlen << 8) | js->tok;
+    saveoff(js, rec, js->toff), saveoff(js, rec + 4, v);
+    saveval(js, rec + 8, js->tval);
+    js->consumed = 1;
+  }
+  if (js->tok != TOK_EOF || n < 2) return;
+  jsoff_t tks = (js->size - TKHDR - n * TKREC) & ~7U;
+  memmove(&js->mem[tks + TKHDR], &js->mem[js->brk], n * TKREC);
+  memcpy(&js->mem[tks], &js->code, sizeof(js->code));
+  saveoff(js, tks + 8, js->clen), saveoff(js, tks + 12, n);
+  saveoff(js, tks + 16, js->tkgen), saveoff(js, tks + 20, js->tkc);
+  js->size = js->tks = tks, js->tki = 0;
+}
+
+// Same as above, but keep the token stream in the token cache
+static void js_compile_cached(struct js *js) {
+  jsoff_t size = js->size, tks;
+  js_compile(js);
+  if ((tks = js->tks) == 0) return;
+  jsoff_t n = TKHDR + loadoff(js, tks + 12) * TKREC;
+  if (js->brk + sizeof(jsoff_t) + n + 1 > js->gct) return;  // Too big, stack it
+  jsval_t str = mkstr(js, NULL, n);
+  memmove(&js->mem[vdata(str) + sizeof(jsoff_t)], &js->mem[tks], n);
+  js->size = size, js->tks = js->tkc = (jsoff_t) (vdata(str) + sizeof(jsoff_t));
+}
+
+// Find a cached token stream for the current code, or compile a new one
+static void js_tkload(struct js *js) {
+  bool inmem = js->code >= (char *) js->mem &&
+               js->code < (char *) &js->mem[js->brk];
+#if JS_CODEREGS
+  if (coderegion(js, js->code, js->clen) >= 0) inmem = true;  // Stays, too
+#endif
+  for (jsoff_t off = js->tkc; inmem && off != 0; off = loadoff(js, off + 20)) {
+    const char *base;
+    memcpy(&base, &js->mem[off], sizeof(base));
+    if (base == js->code && loadoff(js, off + 8) == js->clen) {
+      js->tks = off, js->tki = 0;
+      return;
+    }
+  }
+  if (inmem) {
+    js_compile_cached(js);
+  } else {
+    js_compile(js);
+  }
+}
+
+// Drop all cached token streams, GC is going to delete them
+static void js_tkflush(struct js *js) {
+  if (js->tks != 0 && js->tks < js->size) js->tks = 0;
+  js->tkgen++, js->tkc = 0;
+}
+#endif
+
 static void mkscope(struct js *js) {
   assert((js->flags & F_NOEXEC) == 0);
   jsoff_t prev = (jsoff_t) vdata(js->scope);
@@ -584,8 +2530,49 @@ static jsval_t js_block(struct js *js, bool create_scope) {
   return res;
 }
 
+#if JS_INDEX
+// Seach for property using object's property index. Return ~0 if no index
+static jsoff_t lkpidx(struct js *js, jsval_t obj, const char *buf, size_t len) {
+  jsoff_t idx = loadoff(js, (jsoff_t) vdata(obj)) & ~3U;
+  if (!isidx(js, idx)) return ~(jsoff_t) 0;
+  return loadoff(js, idxslot(js, idxtbl(js, idx), buf, len));
+}
+#endif
+
+#if JS_ATOMS
+// Seach for property in a single object, by atom offset
+static jsoff_t lkpatom(struct js *js, jsval_t obj, const char *buf, size_t len,
+                       jsoff_t atom) {
+  jsoff_t off = loadoff(js, (jsoff_t) vdata(obj)) & ~3U;  // Load first prop off
+  if (atom == 0) return 0;  // No such atom - no such property anywhere
+#if JS_INDEX
+  jsoff_t n = lkpidx(js, obj, buf, len);
+  if (n != ~(jsoff_t) 0) return n;
+  n = 0;
+#else
+  (void) buf, (void) len;
+#endif
+  while (off < js->brk && off != 0) {  // Iterate over props
+    if (loadoff(js, (jsoff_t) (off + sizeof(off))) == atom) return off;
+    off = loadoff(js, off) & ~3U;  // Load next prop offset
+#if JS_INDEX
+    if (++n == INDEX_MIN && mkidx(js, obj)) return lkpidx(js, obj, buf, len);
+#endif
+  }
+  return 0;  // Not found
+}
+#endif
+
 // Seach for property in a single object
 static jsoff_t lkp(struct js *js, jsval_t obj, const char *buf, size_t len) {
+#if JS_ATOMS
+  if (js->atoms != 0) return lkpatom(js, obj, buf, len, atomfind(js, buf, len));
+#endif
+#if JS_INDEX
+  jsoff_t n = lkpidx(js, obj, buf, len);
+  if (n != ~(jsoff_t) 0) return n;
+  n = 0;
+#endif
   jsoff_t off = loadoff(js, (jsoff_t) vdata(obj)) & ~3U;  // Load first prop off
   // printf("LKP: %lu %u [%.*s]\n", vdata(obj), off, (int) len, buf);
   while (off < js->brk && off != 0) {  // Iterate over props
@@ -595,6 +2582,9 @@ static jsoff_t lkp(struct js *js, jsval_t obj, const char *buf, size_t len) {
     // printf("  %u %u[%.*s]\n", off, (int) klen, (int) klen, p);
     if (streq(buf, len, p, klen)) return off;  // Found !
     off = loadoff(js, off) & ~3U;              // Load next prop offset
+#if JS_INDEX
+    if (++n == INDEX_MIN && mkidx(js, obj)) return lkpidx(js, obj, buf, len);
+#endif
   }
   return 0;  // Not found
 }
@@ -602,8 +2592,24 @@ static jsoff_t lkp(struct js *js, jsval_t obj, const char *buf, size_t len) {
 // Lookup variable in the scope chain
 static jsval_t lookup(struct js *js, const char *buf, size_t len) {
   if (js->flags & F_NOEXEC) return 0;
+#if JS_ICACHE
+  jsoff_t depth = 0, hit = icfind(js, buf, len, js->scope, true);
+  if (hit != 0) return mkval(T_PROP, hit);  // Cache hit
+#endif
+#if JS_ATOMS
+  jsoff_t atom = js->atoms == 0 ? 0 : atomfind(js, buf, len);
+#endif
   for (jsval_t scope = js->scope;;) {
+#if JS_ATOMS
+    jsoff_t off = js->atoms == 0 ? lkp(js, scope, buf, len)
+                                 : lkpatom(js, scope, buf, len, atom);
+#else
     jsoff_t off = lkp(js, scope, buf, len);
+#endif
+#if JS_ICACHE
+    if (off != 0) icput(js, buf, len, scope, off, depth);
+    depth++;
+#endif
     if (off != 0) return mkval(T_PROP, off);
     if (vdata(scope) == 0) break;
     scope =
@@ -613,12 +2619,45 @@ static jsval_t lookup(struct js *js, const char *buf, size_t len) {
 }
 
 static jsval_t resolveprop(struct js *js, jsval_t v) {
+#if JS_ARRAY
+  if (vtype(v) == T_ELEM) {
+    return loadval(js, arrslot(js, elemarr(v), elemidx(v)));
+  }
+#endif
+#if JS_TYPED
+  if (vtype(v) == T_TELEM) return tov(taget(js, elemarr(v), elemidx(v)));
+#endif
   if (vtype(v) != T_PROP) return v;
   return resolveprop(js,
                      loadval(js, (jsoff_t) (vdata(v) + sizeof(jsoff_t) * 2)));
 }
 
 static jsval_t assign(struct js *js, jsval_t lhs, jsval_t val) {
+#if JS_INCGC
+  js_wb(js, val);
+#endif
+#if JS_ARRAY
+  if (vtype(lhs) == T_ELEM) {
+    jsoff_t off = elemarr(lhs);
+    if (elemidx(lhs) >= arrlen(loadoff(js, off)))
+      return js_mkerr(js, "bad index");
+#if JS_NURSERY
+    js_remember(js, off, val);
+#endif
+    saveval(js, arrslot(js, off, elemidx(lhs)), val);
+    return lhs;
+  }
+#endif
+#if JS_TYPED
+  if (vtype(lhs) == T_TELEM) {
+    if (vtype(val) != T_NUM) return js_mkerr(js, "type mismatch");
+    taset(js, elemarr(lhs), elemidx(lhs), tod(val));
+    return lhs;
+  }
+#endif
+#if JS_NURSERY
+  js_remember(js, (jsoff_t) vdata(lhs) & ~3U, val);
+#endif
   saveval(js, (jsoff_t) ((vdata(lhs) & ~3U) + sizeof(jsoff_t) * 2), val);
   return lhs;
 }
@@ -631,24 +2670,37 @@ static jsval_t do_assign_op(struct js *js, uint8_t op, jsval_t l, jsval_t r) {
 }
 
 static jsval_t do_string_op(struct js *js, uint8_t op, jsval_t l, jsval_t r) {
-  jsoff_t n1, off1 = vstr(js, l, &n1);
-  jsoff_t n2, off2 = vstr(js, r, &n2);
+#if JS_ROPE
+  jsoff_t len = vstrlen(js, l) + vstrlen(js, r);
+  if (op == TOK_PLUS && len >= ROPE_MIN && !is_sstr(l) &&
+      !is_ext(loadoff(js, (jsoff_t) vdata(l))))
+    return mkrope(js, l, r, len);
+  if (is_err(l = strflat(js, l))) return l;
+  if (is_err(r = strflat(js, r))) return r;
+#endif
+  char b1[SSTR_MAX + 1], b2[SSTR_MAX + 1];
+  jsoff_t n1, n2;
+  const char *p1 = vptr(js, l, b1, &n1), *p2 = vptr(js, r, b2, &n2);
   if (op == TOK_PLUS) {
-    jsval_t res = js_mkstr(js, NULL, n1 + n2);
-    // printf("STRPLUS %u %u %u %u [%.*s] [%.*s]\n", n1, off1, n2, off2, (int)
-    // n1,
-    //       &js->mem[off1], (int) n2, &js->mem[off2]);
+    if (JS_SHORTSTR && n1 + n2 <= SSTR_MAX) {
+      char buf[SSTR_MAX * 2];
+      memcpy(buf, p1, n1), memcpy(buf + n1, p2, n2);
+      return mksstr(buf, n1 + n2);
+    }
+    jsval_t res = mkstr(js, NULL, n1 + n2);
+    // printf("STRPLUS %u %u [%.*s] [%.*s]\n", n1, n2, (int) n1, p1, (int) n2,
+    //        p2);
     if (vtype(res) == T_STR) {
       jsoff_t n, off = vstr(js, res, &n);
-      memmove(&js->mem[off], &js->mem[off1], n1);
-      memmove(&js->mem[off + n1], &js->mem[off2], n2);
+      memmove(&js->mem[off], p1, n1);
+      memmove(&js->mem[off + n1], p2, n2);
     }
     return res;
   } else if (op == TOK_EQ) {
-    bool eq = n1 == n2 && memcmp(&js->mem[off1], &js->mem[off2], n1) == 0;
+    bool eq = n1 == n2 && memcmp(p1, p2, n1) == 0;
     return mkval(T_BOOL, eq ? 1 : 0);
   } else if (op == TOK_NE) {
-    bool eq = n1 == n2 && memcmp(&js->mem[off1], &js->mem[off2], n1) == 0;
+    bool eq = n1 == n2 && memcmp(p1, p2, n1) == 0;
     return mkval(T_BOOL, eq ? 0 : 1);
   } else {
     return js_mkerr(js, "bad str op");
@@ -660,64 +2712,192 @@ static jsval_t do_dot_op(struct js *js, jsval_t l, jsval_t r) {
   if (vtype(r) != T_CODEREF) return js_mkerr(js, "ident expected");
   // Handle stringvalue.length
   if (vtype(l) == T_STR && streq(ptr, codereflen(r), "length", 6)) {
-    return tov(offtolen(loadoff(js, (jsoff_t) vdata(l))));
+    return tov(vstrlen(js, l));
+  }
+#if JS_ARRAY
+  if (vtype(l) == T_ARR && streq(ptr, codereflen(r), "length", 6)) {
+    return tov(arrlen(loadoff(js, (jsoff_t) vdata(l))));
+  }
+#endif
+#if JS_TYPED
+  if (vtype(l) == T_TYPED && streq(ptr, codereflen(r), "length", 6)) {
+    return tov(talen(js, (jsoff_t) vdata(l)));
+  }
+#endif
+#if JS_MAP
+  if (vtype(l) == T_MAP && streq(ptr, codereflen(r), "size", 4)) {
+    return tov(mapcnt(js, (jsoff_t) vdata(l), 0));
   }
+#endif
   if (vtype(l) != T_OBJ) return js_mkerr(js, "lookup in non-obj");
+#if JS_ICACHE
+  jsoff_t off = icfind(js, ptr, codereflen(r), l, false);
+  if (off != 0) return mkval(T_PROP, off);  // Cache hit
+  off = lkp(js, l, ptr, codereflen(r));
+  if (off != 0) icput(js, ptr, codereflen(r), l, off, 0);
+#else
   jsoff_t off = lkp(js, l, ptr, codereflen(r));
+#endif
   return off == 0 ? js_mkundef() : mkval(T_PROP, off);
 }
 
-static jsval_t js_call_params(struct js *js) {
-  jsoff_t pos = js->pos;
+static void reverse(jsval_t *args, int nargs) {
+  for (int i = 0; i < nargs / 2; i++) {
+    jsval_t tmp = args[i];
+    args[i] = args[nargs - i - 1], args[nargs - i - 1] = tmp;
+  }
+}
+
+// Push argument frame that holds `v`. Return frame offset, or 0
+static jsoff_t argpush(struct js *js, jsval_t v) {
+  jsoff_t f = js->size - ARGHDR;
+  if (js->brk + ARGHDR + sizeof(v) > js->size) return 0;
+  saveoff(js, f, js->argf), saveoff(js, f + 4, 1);
+  saveval(js, argslot(f, 0), v);
+  js->argf = f, js->size = argslot(f, 0);
+#if JS_INCGC
+  js_wb(js, v);
+#endif
+  return f;
+}
+
+static void argpop(struct js *js, jsoff_t f) {
+  setlwm(js);
+  js->argf = loadoff(js, f), js->size = f + ARGHDR;
+}
+
+// Add value to the argument frame `f`, which must be the innermost one
+static bool argadd(struct js *js, jsoff_t f, jsval_t v) {
+  if (js->brk + sizeof(v) > js->size) return false;
+  js->size -= (jsoff_t) sizeof(v);
+  saveval(js, js->size, v);
+  saveoff(js, f + (jsoff_t) sizeof(f), argnvals(js, f) + 1);
+#if JS_INCGC
+  js_wb(js, v);
+#endif
+  return true;
+}
+
+// Replace value `i` in the argument frame `f`
+static void argset(struct js *js, jsoff_t f, jsoff_t i, jsval_t v) {
+  saveval(js, argslot(f, i), v);
+#if JS_INCGC
+  js_wb(js, v);
+#endif
+}
+
+// Evaluate a list "(a, b)" or "[a, b]" once, left to right, and add values
+// to the argument frame `f`, in order from the top of the memory stack. If
+// `f` is 0, or after an error, the list is skipped without execution
+static jsval_t js_args(struct js *js, jsoff_t f, uint8_t end) {
+  jsval_t res = js_mkundef();
+  jsoff_t n = 0;
   uint8_t flags = js->flags;
-  js->flags |= F_NOEXEC;
+  if (f == 0) js->flags |= F_NOEXEC;
   js->consumed = 1;
   for (bool comma = false; next(js) != TOK_EOF; comma = true) {
-    if (!comma && next(js) == TOK_RPAREN) break;
-    js_expr(js);
-    if (next(js) == TOK_RPAREN) break;
-    EXPECT(TOK_COMMA, js->flags = flags);
+    if (next(js) == end && (!comma || end == TOK_RBRACKET)) break;  // [1,]
+    if (next(js) == TOK_COMMA || next(js) == end) {  // Missing value
+      if (!is_err(res)) res = js_mkerr(js, "parse error");
+      break;
+    }
+    jsval_t v = js_expr(js);
+    if (!(js->flags & F_NOEXEC)) {
+      v = resolveprop(js, v);
+      if (!is_err(v) && !argadd(js, f, v)) v = js_mkerr(js, "oom");
+      if (is_err(v)) {
+        res = v;
+        js->flags |= F_NOEXEC;  // Skip the rest
+      } else {
+        n++;
+      }
+    }
+    if (next(js) != TOK_COMMA) break;
+    js->consumed = 1;
   }
-  EXPECT(TOK_RPAREN, js->flags = flags);
   js->flags = flags;
-  return mkcoderef(pos, js->pos - pos - js->tlen);
+  if (next(js) == end) {
+    js->consumed = 1;
+  } else if (!is_err(res)) {
+    res = js_mkerr(js, "parse error");
+  }
+  if (!is_err(res) && f != 0) reverse((jsval_t *) &js->mem[js->size], (int) n);
+  return res;
 }
 
-static void reverse(jsval_t *args, int nargs) {
-  for (int i = 0; i < nargs / 2; i++) {
-    jsval_t tmp = args[i];
-    args[i] = args[nargs - i - 1], args[nargs - i - 1] = tmp;
-  }
+// Typed C function is a T_CFUNC value with bit 47 set, and a pointer to
+// struct jsfun in the rest of the payload. Arguments are unboxed according to
+// the signature into an array on the C stack, see js_mkfun_typed()
+#define TF_MAX 8  // Max number of arguments of a typed C function
+
+static const struct jsfun *tfunc(jsval_t v) {
+  return (const struct jsfun *) (uintptr_t) (vdata(v) & ~((size_t) 1 << 47U));
 }
 
-// Call native C function
-static jsval_t call_c(struct js *js,
-                      jsval_t (*fn)(struct js *, jsval_t *, int)) {
-  int argc = 0;
-  while (js->pos < js->clen) {
-    if (next(js) == TOK_RPAREN) break;
-    jsval_t arg = resolveprop(js, js_expr(js));
-    if (js->brk + sizeof(arg) > js->size) return js_mkerr(js, "call oom");
-    js->size -= (jsoff_t) sizeof(arg);
-    memcpy(&js->mem[js->size], &arg, sizeof(arg));
-    argc++;
-    // printf("  arg %d -> %s\n", argc, js_str(js, arg));
-    if (next(js) == TOK_COMMA) js->consumed = 1;
+// Check and unbox arguments, call typed C function, box its result
+static jsval_t tfcall(struct js *js, const struct jsfun *f, jsval_t *args,
+                      int nargs) {
+  jsarg_t a[TF_MAX], r;
+  char bufs[TF_MAX][SSTR_MAX + 1];  // Short string arguments go here
+  const char *sig = f->sig;
+  int i = 0;
+  for (; *sig != '>'; sig++, i++) {
+    jsval_t v = i < nargs ? args[i] : js_mkundef();
+    uint8_t t = vtype(v);
+    double d = tod(v);
+    if (t == T_ERR) return v;
+    if (*sig == 'd' && t == T_NUM) {
+      a[i].d = d;
+    } else if (*sig == 'i' && t == T_NUM && d > -2147483649.0 &&
+               d < 2147483648.0) {
+      a[i].i = (int) d;
+    } else if (*sig == 'b' && t == T_BOOL) {
+      a[i].b = vdata(v) & 1;
+    } else if (*sig == 's' && t == T_STR) {
+      jsoff_t n;
+#if JS_ROPE
+      if (is_err(v = strflat(js, v))) return v;
+#endif
+      a[i].s.ptr = vptr(js, v, bufs[i], &n);
+      a[i].s.len = n;
+    } else if (*sig == 'j') {
+      a[i].j = v;
+    } else {
+      return js_mkerr(js, "bad arg %d", i + 1);
+    }
   }
-  reverse((jsval_t *) &js->mem[js->size], argc);
-  jsval_t res = fn(js, (jsval_t *) &js->mem[js->size], argc);
+  if (nargs > i) return js_mkerr(js, "%d args expected", i);
+  r = f->fn(js, a);
   setlwm(js);
-  js->size += (jsoff_t) sizeof(jsval_t) * (jsoff_t) argc;  // Restore stack
-  return res;
+  switch (sig[1]) {
+    case 'd': return tov(r.d);
+    case 'i': return tov((double) r.i);
+    case 'b': return mkval(T_BOOL, r.b ? 1 : 0);
+    case 's': return js_mkstr(js, r.s.ptr, r.s.len);
+    case 'j': return r.j;
+    default: return js_mkundef();
+  }
 }
 
 // Call JS function. 'fn' looks like this: "(a,b) { return a + b; }"
-static jsval_t call_js(struct js *js, const char *fn, jsoff_t fnlen) {
+// Arguments are already evaluated into the frame `f`, or there is no frame
+// if `f` is 0. Missing arguments are undefined. The frame is popped as soon
+// as arguments are bound, so a recursive call takes no more memory than
+// its scope and the parameters in it
+static jsval_t call_js(struct js *js, const char *fn, jsoff_t fnlen,
+                       jsoff_t f) {
+  const jsval_t *args = (jsval_t *) &js->mem[js->size];
+  int argc = 0, nargs = f == 0 ? 0 : (int) argnvals(js, f) - 1;
   jsoff_t fnpos = 1;
   // printf("JSCALL [%.*s] -> %.*s\n", (int) js->clen, js->code, (int) fnlen,
   // fn);
   // printf("JSCALL, nogc %u [%.*s]\n", js->nogc, (int) fnlen, fn);
-  mkscope(js);  // Create function call scope
+  jsval_t res = mkobj(js, (jsoff_t) vdata(js->scope));  // Call scope
+  if (is_err(res)) {
+    if (f != 0) argpop(js, f);
+    return res;
+  }
+  js->scope = res;
   // Loop over arguments list "(a, b)" and set scope variables
   while (fnpos < fnlen) {
     fnpos = skiptonext(fn, fnlen, fnpos);          // Skip to the identifier
@@ -728,54 +2908,94 @@ static jsval_t call_js(struct js *js, const char *fn, jsoff_t fnlen) {
     // Here we have argument name. Calculate arg value
     // printf("  [%.*s] -> %u [%.*s] -> ", (int) identlen, &fn[fnpos], js->pos,
     //       (int) js->clen, js->code);
-    js->pos = skiptonext(js->code, js->clen, js->pos);
-    js->consumed = 1;
-    jsval_t v = js->code[js->pos] == ')' ? js_mkundef() : js_expr(js);
+    jsval_t v = argc < nargs ? args[argc] : js_mkundef();
+    argc++;
     // Set argument in the function scope
-    setprop(js, js->scope, js_mkstr(js, &fn[fnpos], identlen), v);
-    js->pos = skiptonext(js->code, js->clen, js->pos);
-    if (js->pos < js->clen && js->code[js->pos] == ',') js->pos++;
+    jsval_t k = mkkey(js, &fn[fnpos], identlen);
+    if (is_err(res = is_err(k) ? k : setprop(js, js->scope, k, v))) break;
     fnpos = skiptonext(fn, fnlen, fnpos + identlen);  // Skip past identifier
     if (fnpos < fnlen && fn[fnpos] == ',') fnpos++;   // And skip comma
   }
-  if (fnpos < fnlen && fn[fnpos] == ')') fnpos++;  // Skip to the function body
-  fnpos = skiptonext(fn, fnlen, fnpos);            // Up to the opening brace
-  if (fnpos < fnlen && fn[fnpos] == '{') fnpos++;  // And skip the brace
-  size_t n = fnlen - fnpos - 1U;  // Function code with stripped braces
-  // printf("flags: %d, body: %zu [%.*s]\n", js->flags, n, (int) n, &fn[fnpos]);
-  js->flags = F_CALL;                        // Mark we're in the function call
-  jsval_t res = js_eval(js, &fn[fnpos], n);  // Call function, no GC
-  if (!is_err(res) && !(js->flags & F_RETURN)) res = js_mkundef();  // No return
+  if (f != 0) argpop(js, f);  // Arguments are in the scope now
+  if (!is_err(res)) {
+    if (fnpos < fnlen && fn[fnpos] == ')') fnpos++;  // Skip to the body
+    fnpos = skiptonext(fn, fnlen, fnpos);            // Up to the opening brace
+    if (fnpos < fnlen && fn[fnpos] == '{') fnpos++;  // And skip the brace
+    size_t n = fnlen - fnpos - 1U;  // Function code with stripped braces
+    // printf("flags: %d, body: %zu [%.*s]\n", js->flags, n, (int) n,
+    // &fn[fnpos]);
+    js->flags = F_CALL;                // Mark we're in the function call
+    res = js_eval(js, &fn[fnpos], n);  // Call function, no GC
+    if (!is_err(res) && !(js->flags & F_RETURN)) res = js_mkundef();
+  }
   delscope(js);  // Delete call scope
   // printf("  -> %d [%s], tok %d\n", js->flags, js_str(js, res), js->tok);
   return res;
 }
 
-static jsval_t do_call_op(struct js *js, jsval_t func, jsval_t args) {
-  if (vtype(args) != T_CODEREF) return js_mkerr(js, "bad call");
-  if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC)
-    return js_mkerr(js, "calling non-function");
-  const char *code = js->code;             // Save current parser state
-  jsoff_t clen = js->clen, pos = js->pos;  // code, position and code length
-  js->code = &js->code[coderefoff(args)];  // Point parser to args
-  js->clen = codereflen(args);             // Set args length
-  js->pos = skiptonext(js->code, js->clen, 0);  // Skip to 1st arg
-  uint8_t tok = js->tok, flags = js->flags;     // Save flags
-  jsoff_t nogc = js->nogc;
-  jsval_t res = js_mkundef();
-  if (vtype(func) == T_FUNC) {
-    jsoff_t fnlen, fnoff = vstr(js, func, &fnlen);
-    js->nogc = (jsoff_t) (fnoff - sizeof(jsoff_t));
-    res = call_js(js, (const char *) (&js->mem[fnoff]), fnlen);
+// Call function `func` with arguments from the frame `f`, which are on top
+// of the JS memory stack, or with no arguments if `f` is 0. The frame is
+// popped. Parser state is restored after the call, unless the call fails.
+// Caller's code and nogc are kept on the C stack, because GC can move them
+static jsval_t callfn(struct js *js, jsval_t func, jsoff_t f) {
+  jsval_t *args = (jsval_t *) &js->mem[js->size], res;
+  int nargs = f == 0 ? 0 : (int) argnvals(js, f) - 1;
+  jsoff_t clen = js->clen, pos = js->pos;
+  uint8_t tok = js->tok, flags = js->flags, consumed = js->consumed;
+  struct jscall c = {js->cf, js->code, js->nogc};
+  if (f != 0) func = loadval(js, argslot(f, 0));
+  js->cf = &c;
+  if (is_tfunc(func)) {
+    res = tfcall(js, tfunc(func), args, nargs);
+  } else if (vtype(func) == T_CFUNC) {
+    jsval_t (*fn)(struct js *, jsval_t *, int) =
+        (jsval_t(*)(struct js *, jsval_t *, int)) vdata(func);
+    res = fn(js, args, nargs);  // Can call js_eval() or js_call()
+  } else {
+    jsoff_t fnlen;
+    const char *fn = vfunc(js, func, &fnlen);
+    if (fnlen == 0) {
+      res = js_mkerr(js, "code region not bound");
+    } else {
+      if (!is_sfunc(func)) js->nogc = (jsoff_t) vdata(func);
+      res = call_js(js, fn, fnlen, f);  // Pops the frame
+      f = 0;
+    }
+  }
+  if (f != 0) argpop(js, f);
+  js->cf = c.prev, js->code = c.code, js->nogc = c.nogc, js->clen = clen;
+  js->flags = flags;
+  if (is_err(res)) {  // Jump to the end, like js_mkerr() does
+    js->pos = clen, js->tok = TOK_EOF, js->consumed = 0;
   } else {
-    res = call_c(js, (jsval_t(*)(struct js *, jsval_t *, int)) vdata(func));
+    js->pos = pos, js->tok = tok, js->consumed = consumed;
   }
-  js->code = code, js->clen = clen, js->pos = pos;  // Restore parser
-  js->flags = flags, js->tok = tok, js->nogc = nogc;
-  js->consumed = 1;
   return res;
 }
 
+// Evaluate call arguments "(a, b)" in one pass, left to right, and call
+// function. Arguments are kept in the argument frame, so they survive GC
+// triggered by calls in the following arguments. A call with no arguments
+// needs no frame
+static jsval_t js_call_args(struct js *js, jsval_t func) {
+  jsoff_t f;
+  func = resolveprop(js, func);
+  if (is_err(func)) return func;
+  if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC)
+    return js_mkerr(js, "calling non-function");
+  if (lookahead(js) == TOK_RPAREN) {
+    js->consumed = 1, next(js), js->consumed = 1;  // Skip "()"
+    return callfn(js, func, 0);
+  }
+  if ((f = argpush(js, func)) == 0) return js_mkerr(js, "call oom");
+  jsval_t res = js_args(js, f, TOK_RPAREN);
+  if (is_err(res)) {
+    argpop(js, f);
+    return res;
+  }
+  return callfn(js, func, f);
+}
+
 // clang-format off
 static jsval_t do_op(struct js *js, uint8_t op, jsval_t lhs, jsval_t rhs) {
   if (js->flags & F_NOEXEC) return 0;
@@ -784,10 +3004,9 @@ static jsval_t do_op(struct js *js, uint8_t op, jsval_t lhs, jsval_t rhs) {
   setlwm(js);
   if (is_err(l)) return l;
   if (is_err(r)) return r;
-  if (is_assign(op) && vtype(lhs) != T_PROP) return js_mkerr(js, "bad lhs");
+  if (is_assign(op) && vtype(lhs) != T_PROP && vtype(lhs) != T_ELEM && vtype(lhs) != T_TELEM) return js_mkerr(js, "bad lhs");
   switch (op) {
     case TOK_TYPEOF:  return js_mkstr(js, typestr(vtype(r)), strlen(typestr(vtype(r))));
-    case TOK_CALL:    return do_call_op(js, l, r);
     case TOK_ASSIGN:  return assign(js, lhs, r);
     case TOK_POSTINC: { do_assign_op(js, TOK_PLUS_ASSIGN, lhs, tov(1)); return l; }
     case TOK_POSTDEC: { do_assign_op(js, TOK_MINUS_ASSIGN, lhs, tov(1)); return l; }
@@ -854,19 +3073,20 @@ static jsval_t js_str_literal(struct js *js) {
       out[n1++] = ((uint8_t *) js->code)[js->toff + n2];
     }
   }
-  return js_mkstr(js, NULL, n1);
+  if (JS_SHORTSTR && n1 <= SSTR_MAX) return mksstr(out, n1);
+  return mkstr(js, NULL, n1);
 }
 
-static jsval_t js_obj_literal(struct js *js) {
+// Parse object literal properties. If executing, the object and the current
+// key are kept in the argument frame `f`, because values can trigger GC
+static jsval_t js_obj_props(struct js *js, jsoff_t f) {
   uint8_t exe = !(js->flags & F_NOEXEC);
-  // printf("OLIT1\n");
-  jsval_t obj = exe ? mkobj(js, 0) : js_mkundef();
-  if (is_err(obj)) return obj;
   js->consumed = 1;
   while (next(js) != TOK_RBRACE) {
     jsval_t key = 0;
+    if (js->tok == TOK_DELETE) js->tok = TOK_IDENTIFIER;  // {delete: 1}
     if (js->tok == TOK_IDENTIFIER) {
-      if (exe) key = js_mkstr(js, js->code + js->toff, js->tlen);
+      if (exe) key = mkkey(js, js->code + js->toff, js->tlen);
     } else if (js->tok == TOK_STRING) {
       if (exe) key = js_str_literal(js);
     } else {
@@ -874,11 +3094,16 @@ static jsval_t js_obj_literal(struct js *js) {
     }
     js->consumed = 1;
     EXPECT(TOK_COLON, );
+    if (exe) {
+      if (is_err(key)) return key;
+      argset(js, f, 1, key);
+    }
     jsval_t val = js_expr(js);
     if (exe) {
       // printf("XXXX [%s] scope: %lu\n", js_str(js, val), vdata(js->scope));
       if (is_err(val)) return val;
-      if (is_err(key)) return key;
+      jsval_t obj = loadval(js, argslot(f, 0));
+      key = loadval(js, argslot(f, 1));
       jsval_t res = setprop(js, obj, key, resolveprop(js, val));
       if (is_err(res)) return res;
     }
@@ -886,8 +3111,195 @@ static jsval_t js_obj_literal(struct js *js) {
     EXPECT(TOK_COMMA, );
   }
   EXPECT(TOK_RBRACE, );
-  return obj;
+  return js_mkundef();
+}
+
+static jsval_t js_obj_literal(struct js *js) {
+  if (js->flags & F_NOEXEC) return js_obj_props(js, 0);
+  jsval_t obj = mkobj(js, 0), res;
+  jsoff_t f;
+  if (is_err(obj)) return obj;
+  if ((f = argpush(js, obj)) == 0 || !argadd(js, f, js_mkundef())) {
+    if (f != 0) argpop(js, f);
+    return js_mkerr(js, "oom");
+  }
+  res = js_obj_props(js, f);
+  if (!is_err(res)) res = loadval(js, argslot(f, 0));
+  argpop(js, f);
+  return res;
+}
+
+#if JS_ARRAY
+// Elements are evaluated into an argument frame first, so GC done by them
+// does not move the array under construction
+static jsval_t js_arr_literal(struct js *js) {
+  if (js->flags & F_NOEXEC) return js_args(js, 0, TOK_RBRACKET);
+  jsoff_t f = argpush(js, js_mkundef());
+  if (f == 0) return js_mkerr(js, "oom");
+  jsval_t res = js_args(js, f, TOK_RBRACKET), arr = res;
+  jsval_t *vals = (jsval_t *) &js->mem[js->size];
+  if (!is_err(res)) res = arr = mkarr(js);
+  for (jsoff_t i = 0; i + 1 < argnvals(js, f) && !is_err(res); i++) {
+    res = arrpush(js, arr, vals[i]);
+  }
+  argpop(js, f);
+  return is_err(res) ? res : arr;
+}
+
+// Array method call: arr.push(a, ...), arr.pop(). Other names are looked up
+// as usual, which handles arr.length
+static jsval_t js_arr_method(struct js *js, jsval_t arr) {
+  jsval_t name = mkcoderef((jsoff_t) js->toff, (jsoff_t) js->tlen), res = 0;
+  const char *ptr = &js->code[coderefoff(name)];
+  js->consumed = 1;
+  if (next(js) != TOK_LPAREN) return do_op(js, TOK_DOT, arr, name);
+  if (streq(ptr, codereflen(name), "push", 4)) {
+    jsoff_t f = argpush(js, arr);  // GC-safe while arguments are evaluated
+    if (f == 0) return js_mkerr(js, "oom");
+    res = js_args(js, f, TOK_RPAREN);
+    jsval_t *vals = (jsval_t *) &js->mem[js->size];
+    arr = loadval(js, argslot(f, 0));
+    if (!is_err(res)) res = tov(arrlen(loadoff(js, (jsoff_t) vdata(arr))));
+    for (jsoff_t i = 0; i + 1 < argnvals(js, f) && !is_err(res); i++) {
+      res = arrpush(js, arr, vals[i]);
+    }
+    argpop(js, f);
+    return res;
+  }
+  js->consumed = 1;
+  if (streq(ptr, codereflen(name), "pop", 3)) {
+    res = arrpop(js, arr);
+  } else {
+    return js_mkerr(js, "no method %.*s", (int) codereflen(name), ptr);
+  }
+  EXPECT(TOK_RPAREN, );
+  return res;
+}
+#endif
+
+#if JS_MAP
+// Constructor call: new Map(), new Set()
+static jsval_t js_new(struct js *js) {
+  if (next(js) != TOK_IDENTIFIER) return js_mkerr(js, "bad new");
+  const char *ptr = &js->code[js->toff];
+  bool set = streq(ptr, js->tlen, "Set", 3);
+  if (!set && !streq(ptr, js->tlen, "Map", 3)) {
+    return js_mkerr(js, "no class %.*s", (int) js->tlen, ptr);
+  }
+  js->consumed = 1;
+  EXPECT(TOK_LPAREN, );
+  EXPECT(TOK_RPAREN, );
+  return js->flags & F_NOEXEC ? js_mkundef() : mkmap(js, set);
+}
+
+#if JS_ARRAY
+// Return an array of Map keys, or values
+static jsval_t mapitems(struct js *js, jsval_t map, bool values) {
+  jsoff_t off = (jsoff_t) vdata(map), w = loadoff(js, off);
+  jsoff_t n = arrlen(w), d = values && !(w & SETBIT) ? 1 : 0;
+  jsval_t arr = mkarr(js), res = arr;
+  for (jsoff_t i = MAP_HDR; i < n && !is_err(res); i += mapstride(w)) {
+    if (vtype(loadval(js, arrslot(js, off, i))) == T_UNDEF) continue;
+    res = arrpush(js, arr, loadval(js, arrslot(js, off, i + d)));
+  }
+  return is_err(res) ? res : arr;
+}
+#endif
+
+// Run Map or Set method `name` with already evaluated arguments
+static jsval_t mapcall(struct js *js, jsval_t map, jsval_t name,
+                       const jsval_t *vals, jsoff_t nvals) {
+  jsval_t args[] = {js_mkundef(), js_mkundef()}, res = js_mkundef();
+  jsoff_t off = (jsoff_t) vdata(map), n = codereflen(name), slot;
+  for (jsoff_t i = 0; i < nvals && i < 2; i++) args[i] = vals[i];
+  const char *ptr = &js->code[coderefoff(name)];
+  bool set = loadoff(js, off) & SETBIT;
+  if (streq(ptr, n, "clear", 5)) {
+    saveoff(js, off + (jsoff_t) sizeof(off), 0);
+    saveoff(js, off, loadoff(js, off) & ~(ARR_MAX << 2));
+    return res;
+  }
+#if JS_ARRAY
+  if (streq(ptr, n, "keys", 4)) return mapitems(js, map, false);
+  if (streq(ptr, n, "values", 6)) return mapitems(js, map, true);
+#endif
+  if (is_err(args[0] = mapkey(js, args[0]))) return args[0];
+  if (streq(ptr, n, set ? "add" : "set", 3)) {
+    res = mapput(js, map, args[0], args[1]);
+  } else if (streq(ptr, n, "has", 3)) {
+    res = mapfind(js, off, args[0]) ? js_mktrue() : js_mkfalse();
+  } else if (streq(ptr, n, "delete", 6)) {
+    res = mapdel(js, map, args[0]) ? js_mktrue() : js_mkfalse();
+  } else if (!set && streq(ptr, n, "get", 3)) {
+    if ((slot = mapfind(js, off, args[0])) != 0) {
+      res = loadval(js, arrslot(js, off, slot + 1));
+    }
+  } else {
+    res = js_mkerr(js, "no method %.*s", (int) n, ptr);
+  }
+  return res;
+}
+
+// Map and Set method call: m.set(k, v), m.get(k), s.add(k), m.has(k),
+// m.delete(k), m.clear(), m.keys(), m.values(). Other names are looked up
+// as usual, which handles m.size. Arguments are evaluated into an argument
+// frame, with the Map, because they can trigger GC
+static jsval_t js_map_method(struct js *js, jsval_t map) {
+  jsval_t name = mkcoderef((jsoff_t) js->toff, (jsoff_t) js->tlen), res;
+  jsoff_t f;
+  js->consumed = 1;
+  if (next(js) != TOK_LPAREN) return do_op(js, TOK_DOT, map, name);
+  if ((f = argpush(js, map)) == 0) return js_mkerr(js, "oom");
+  res = js_args(js, f, TOK_RPAREN);
+  if (!is_err(res)) {
+    res = mapcall(js, loadval(js, argslot(f, 0)), name,
+                  (jsval_t *) &js->mem[js->size], argnvals(js, f) - 1);
+  }
+  argpop(js, f);
+  return res;
+}
+#endif
+
+#if JS_ARRAY || JS_TYPED
+// Element access: arr[index]. Return an element lvalue if possible
+static jsval_t js_index(struct js *js, jsval_t obj) {
+  jsoff_t f = 0;
+  if (!(js->flags & F_NOEXEC) && (f = argpush(js, obj)) == 0)
+    return js_mkerr(js, "oom");
+  js->consumed = 1;
+  jsval_t idx = js_expr(js);
+  if (f != 0) {  // Index expression can trigger GC, which moves `obj`
+    obj = loadval(js, argslot(f, 0));
+    argpop(js, f);
+  }
+  if (is_err(idx)) return idx;
+  if (next(js) != TOK_RBRACKET) return js_mkerr(js, "] expected");
+  js->consumed = 1;
+  if (js->flags & F_NOEXEC) return 0;
+  jsval_t arr = resolveprop(js, obj);
+  double d = tod(resolveprop(js, idx));
+  if (is_err(arr)) return arr;
+  if (vtype(resolveprop(js, idx)) != T_NUM) return js_mkerr(js, "bad index");
+  double ip;  // Range check goes first: converting -1 or 1e20 is undefined
+  bool ok = d >= 0 && d < 4294967295.0 && modf(d, &ip) == 0.0;
+  jsoff_t off = (jsoff_t) vdata(arr), i = ok ? (jsoff_t) d : 0;
+#if JS_ARRAY
+  if (vtype(arr) == T_ARR) {
+    if (!ok || i >= arrlen(loadoff(js, off))) return js_mkundef();
+    if (i >= ELEM_MAX) return loadval(js, arrslot(js, off, i));
+    return mkval(T_ELEM, (uint64_t) i << 30 | off >> 2);
+  }
+#endif
+#if JS_TYPED
+  if (vtype(arr) == T_TYPED) {
+    if (!ok || i >= talen(js, off)) return js_mkundef();
+    if (i >= ELEM_MAX) return tov(taget(js, off, i));
+    return mkval(T_TELEM, (uint64_t) i << 30 | off >> 2);
+  }
+#endif
+  return js_mkerr(js, "bad index");
 }
+#endif
 
 static jsval_t js_func_literal(struct js *js) {
   uint8_t flags = js->flags;  // Save current flags
@@ -910,32 +3322,36 @@ static jsval_t js_func_literal(struct js *js) {
     return res;
   }
   js->flags = flags;  // Restore flags
-  jsval_t str = js_mkstr(js, &js->code[pos], js->pos - pos);
+#if JS_CODEREGS
+  jsval_t sf = mksfunc(js, &js->code[pos], js->pos - pos);
+  if (sf != 0) {
+    js->consumed = 1;
+    return sf;  // Source stays in its code region, do not copy it
+  }
+#endif
+  jsval_t str = mkstr(js, &js->code[pos], js->pos - pos);
   js->consumed = 1;
   // printf("FUNC: %u [%.*s]\n", pos, js->pos - pos, &js->code[pos]);
   return mkval(T_FUNC, (unsigned long) vdata(str));
 }
 
-#define RTL_BINOP(_f1, _f2, _cond)  \
-  jsval_t res = _f1(js);            \
-  while (!is_err(res) && (_cond)) { \
-    uint8_t op = js->tok;           \
-    js->consumed = 1;               \
-    jsval_t rhs = _f2(js);          \
-    if (is_err(rhs)) return rhs;    \
-    res = do_op(js, op, res, rhs);  \
-  }                                 \
-  return res;
-
-#define LTR_BINOP(_f, _cond)        \
-  jsval_t res = _f(js);             \
-  while (!is_err(res) && (_cond)) { \
-    uint8_t op = js->tok;           \
-    js->consumed = 1;               \
-    jsval_t rhs = _f(js);           \
-    if (is_err(rhs)) return rhs;    \
-    res = do_op(js, op, res, rhs);  \
-  }                                 \
+// Left to right. The lhs value is kept in an argument frame while the rhs
+// is evaluated, if it refers to JS memory, because the rhs can trigger GC
+#define LTR_BINOP(_f, _cond)                                     \
+  jsval_t res = _f(js);                                          \
+  while (!is_err(res) && (_cond)) {                              \
+    uint8_t op = js->tok;                                        \
+    jsoff_t f = 0;                                               \
+    js->consumed = 1;                                            \
+    if (!(js->flags & F_NOEXEC)) res = resolveprop(js, res);     \
+    if (!(js->flags & F_NOEXEC) && rootoff(res) != 0 &&          \
+        (f = argpush(js, res)) == 0)                             \
+      return js_mkerr(js, "oom");                                \
+    jsval_t rhs = _f(js);                                        \
+    if (f != 0) res = loadval(js, argslot(f, 0)), argpop(js, f); \
+    if (is_err(rhs)) return rhs;                                 \
+    res = do_op(js, op, res, rhs);                               \
+  }                                                              \
   return res;
 
 static jsval_t js_literal(struct js *js) {
@@ -949,6 +3365,12 @@ static jsval_t js_literal(struct js *js) {
     case TOK_NUMBER:      return js->tval;
     case TOK_STRING:      return js_str_literal(js);
     case TOK_LBRACE:      return js_obj_literal(js);
+#if JS_ARRAY
+    case TOK_LBRACKET:    return js_arr_literal(js);
+#endif
+#if JS_MAP
+    case TOK_NEW:         return js_new(js);
+#endif
     case TOK_FUNC:        return js_func_literal(js);
     case TOK_NULL:        return js_mknull();
     case TOK_UNDEF:       return js_mkundef();
@@ -972,27 +3394,54 @@ static jsval_t js_group(struct js *js) {
   }
 }
 
-static jsval_t js_call_dot(struct js *js) {
+// Parse calls, dots and indexing. If `owner` is not NULL, it receives the
+// object of the last dot access, or undefined if the last one is not a dot
+static jsval_t js_call_dot(struct js *js, jsval_t *owner) {
   jsval_t res = js_group(js);
   if (is_err(res)) return res;
   if (vtype(res) == T_CODEREF) {
     res = lookup(js, &js->code[coderefoff(res)], codereflen(res));
   }
-  while (next(js) == TOK_LPAREN || next(js) == TOK_DOT) {
+  while (next(js) == TOK_LPAREN || next(js) == TOK_DOT ||
+         next(js) == TOK_LBRACKET) {
     if (js->tok == TOK_DOT) {
       js->consumed = 1;
+      if (next(js) == TOK_DELETE) js->tok = TOK_IDENTIFIER;  // m.delete(k)
+#if JS_MAP
+      if (!(js->flags & F_NOEXEC) && vtype(resolveprop(js, res)) == T_MAP &&
+          next(js) == TOK_IDENTIFIER) {
+        res = js_map_method(js, resolveprop(js, res));
+        continue;
+      }
+#endif
+#if JS_ARRAY
+      if (!(js->flags & F_NOEXEC) && vtype(resolveprop(js, res)) == T_ARR &&
+          next(js) == TOK_IDENTIFIER) {
+        res = js_arr_method(js, resolveprop(js, res));
+        continue;
+      }
+#endif
+      if (owner != NULL) *owner = resolveprop(js, res);
       res = do_op(js, TOK_DOT, res, js_group(js));
-    } else {
-      jsval_t params = js_call_params(js);
+      continue;
+#if JS_ARRAY || JS_TYPED
+    } else if (js->tok == TOK_LBRACKET) {
+      res = js_index(js, res);
+#endif
+    } else if (js->flags & F_NOEXEC) {
+      jsval_t params = js_args(js, 0, TOK_RPAREN);  // Skip arguments
       if (is_err(params)) return params;
-      res = do_op(js, TOK_CALL, res, params);
+    } else {
+      res = js_call_args(js, res);
+      if (is_err(res)) return res;
     }
+    if (owner != NULL) *owner = js_mkundef();
   }
   return res;
 }
 
 static jsval_t js_postfix(struct js *js) {
-  jsval_t res = js_call_dot(js);
+  jsval_t res = js_call_dot(js, NULL);
   if (is_err(res)) return res;
   next(js);
   if (js->tok == TOK_POSTINC || js->tok == TOK_POSTDEC) {
@@ -1002,7 +3451,19 @@ static jsval_t js_postfix(struct js *js) {
   return res;
 }
 
+// Delete operator: delete obj.prop. Variables cannot be deleted
+static jsval_t js_delete(struct js *js) {
+  jsval_t owner = js_mkundef(), res;
+  js->consumed = 1;
+  res = js_call_dot(js, &owner);
+  if (is_err(res) || (js->flags & F_NOEXEC)) return res;
+  if (vtype(owner) != T_OBJ) return js_mkfalse();
+  if (vtype(res) == T_PROP) delprop(js, owner, (jsoff_t) vdata(res));
+  return js_mktrue();
+}
+
 static jsval_t js_unary(struct js *js) {
+  if (next(js) == TOK_DELETE) return js_delete(js);
   if (next(js) == TOK_NOT || js->tok == TOK_TILDA || js->tok == TOK_TYPEOF ||
       js->tok == TOK_MINUS || js->tok == TOK_PLUS) {
     uint8_t t = js->tok;
@@ -1092,7 +3553,7 @@ static jsval_t js_ternary(struct js *js) {
     uint8_t flags = js->flags;
     js->consumed = 1;
     if (js_truthy(js, resolveprop(js, res))) {
-      res = js_ternary(js);
+      if (is_err(res = js_ternary(js))) return res;
       js->flags |= F_NOEXEC;
       EXPECT(TOK_COLON, js->flags = flags);
       js_ternary(js);
@@ -1108,14 +3569,31 @@ static jsval_t js_ternary(struct js *js) {
   return res;
 }
 
+// Right to left. The lhs is kept in an argument frame while the rhs is
+// evaluated, because the rhs can trigger GC, which moves the lhs
 static jsval_t js_assignment(struct js *js) {
-  RTL_BINOP(js_ternary, js_assignment,
-            (next(js) == TOK_ASSIGN || js->tok == TOK_PLUS_ASSIGN ||
-             js->tok == TOK_MINUS_ASSIGN || js->tok == TOK_MUL_ASSIGN ||
-             js->tok == TOK_DIV_ASSIGN || js->tok == TOK_REM_ASSIGN ||
-             js->tok == TOK_SHL_ASSIGN || js->tok == TOK_SHR_ASSIGN ||
-             js->tok == TOK_ZSHR_ASSIGN || js->tok == TOK_AND_ASSIGN ||
-             js->tok == TOK_XOR_ASSIGN || js->tok == TOK_OR_ASSIGN));
+  jsval_t res = js_ternary(js);
+  while (!is_err(res) &&
+         (next(js) == TOK_ASSIGN || js->tok == TOK_PLUS_ASSIGN ||
+          js->tok == TOK_MINUS_ASSIGN || js->tok == TOK_MUL_ASSIGN ||
+          js->tok == TOK_DIV_ASSIGN || js->tok == TOK_REM_ASSIGN ||
+          js->tok == TOK_SHL_ASSIGN || js->tok == TOK_SHR_ASSIGN ||
+          js->tok == TOK_ZSHR_ASSIGN || js->tok == TOK_AND_ASSIGN ||
+          js->tok == TOK_XOR_ASSIGN || js->tok == TOK_OR_ASSIGN)) {
+    uint8_t op = js->tok;
+    jsoff_t f = 0;
+    js->consumed = 1;
+    if (!(js->flags & F_NOEXEC) && (f = argpush(js, res)) == 0)
+      return js_mkerr(js, "oom");
+    jsval_t rhs = js_assignment(js);
+    if (f != 0) {
+      res = loadval(js, argslot(f, 0));
+      argpop(js, f);
+    }
+    if (is_err(rhs)) return rhs;
+    res = do_op(js, op, res, rhs);
+  }
+  return res;
 }
 
 static jsval_t js_expr(struct js *js) {
@@ -1141,7 +3619,7 @@ static jsval_t js_let(struct js *js) {
       if (lkp(js, js->scope, name, nlen) > 0)
         return js_mkerr(js, "'%.*s' already declared", (int) nlen, name);
       jsval_t x =
-          setprop(js, js->scope, js_mkstr(js, name, nlen), resolveprop(js, v));
+          setprop(js, js->scope, mkkey(js, name, nlen), resolveprop(js, v));
       if (is_err(x)) return x;
     }
     if (next(js) == TOK_SEMICOLON || next(js) == TOK_EOF) break;  // Stop
@@ -1290,11 +3768,23 @@ static jsval_t js_return(struct js *js) {
 static jsval_t js_stmt(struct js *js) {
   jsval_t res;
   // jsoff_t pos = js->pos - js->tlen;
+#if JS_NURSERY
+  // Callers keep pointers to their code on the C stack, and the code could
+  // be in the nursery. Collect the nursery outside of function calls only
+  if (js->brk <= js->gct && !(js->flags & F_CALL)) js_minor_gc(js);
+#endif
+#if JS_INCGC
+  js_gcslice(js);
+#else
   if (js->brk > js->gct) js_gc(js);
+#endif
   switch (next(js)) {  // clang-format off
     case TOK_CASE: case TOK_CATCH: case TOK_CLASS: case TOK_CONST:
-    case TOK_DEFAULT: case TOK_DELETE: case TOK_DO: case TOK_FINALLY:
-    case TOK_IN: case TOK_INSTANCEOF: case TOK_NEW: case TOK_SWITCH:
+    case TOK_DEFAULT: case TOK_DO: case TOK_FINALLY:
+    case TOK_IN: case TOK_INSTANCEOF: case TOK_SWITCH:
+#if !JS_MAP
+    case TOK_NEW:  // Otherwise, it starts an expression: new Map()
+#endif
     case TOK_THIS: case TOK_THROW: case TOK_TRY: case TOK_VAR: case TOK_VOID:
     case TOK_WITH: case TOK_WHILE: case TOK_YIELD:
       res = js_mkerr(js, "'%.*s' not implemented", (int) js->tlen, js->code + js->toff);
@@ -1329,6 +3819,155 @@ struct js *js_create(void *buf, size_t len) {
   return js;
 }
 
+// Snapshot is a copy of struct js followed by the used JS memory. All
+// entities refer to each other by offsets, so a snapshot works at any
+// address. The exception is C function pointers: in a snapshot, `cstk`
+// holds the address of js_create(), and js_restore() shifts C function
+// pointers by the distance that js_create() has moved
+size_t js_snapshot(struct js *js, void *buf, size_t len) {
+  size_t n = sizeof(*js) + js->brk;
+  if (len < n) return n;
+  struct js *snap = (struct js *) buf;
+  memcpy(snap, js, sizeof(*js));
+  memcpy(snap + 1, js->mem, js->brk);
+  snap->cstk = (void *) js_create;
+  return n;
+}
+
+struct js *js_restore(void *buf, size_t len) {
+  struct js *js = (struct js *) buf;
+  if (len < sizeof(*js) + esize(T_OBJ)) return NULL;
+  size_t shift = (size_t) (void *) js_create - (size_t) js->cstk;
+  js->mem = (uint8_t *) (js + 1);
+  js->size = (jsoff_t) ((len - sizeof(*js)) / 8U * 8U);
+  if (js->brk > js->size) return NULL;
+  if (js->gct > js->size) js->gct = js->size / 2;
+  js->lwm = js->size - js->brk;
+  js->code = "", js->clen = js->pos = 0, js->cstk = NULL, js->flags = 0;
+  js->argf = 0, js->cf = NULL;  // Calls are not part of a snapshot
+#if JS_CODEREGS
+  for (int i = 0; js->regs != 0 && i < JS_CODEREGS; i++) {  // Unbind regions
+    memset(&js->mem[js->regs + sizeof(jsoff_t) + (size_t) i * REGREC], 0, 8);
+  }
+#endif
+  for (jsoff_t v, off = 0; off < js->brk; off += esize(v)) {
+    v = loadoff(js, off);
+    if (is_ext(v)) memset(&js->mem[off + sizeof(off) + 8], 0, 8);  // Not owned
+    if (shift == 0) continue;
+#if JS_ARRAY || JS_MAP
+    for (jsoff_t i = 0; is_arrent(v) && i < arrlen(v); i++) {
+      jsval_t val = loadval(js, arrslot(js, off, i));
+      if (vtype(val) != T_CFUNC) continue;
+      saveval(js, arrslot(js, off, i), mkval(T_CFUNC, vdata(val) + shift));
+    }
+#endif
+    if ((v & 3) != T_PROP) continue;
+    jsoff_t voff = off + (jsoff_t) sizeof(off) * 2;
+    jsval_t val = loadval(js, voff);
+    if (vtype(val) != T_CFUNC) continue;
+    saveval(js, voff, mkval(T_CFUNC, vdata(val) + shift));
+  }
+#if JS_PINS
+  for (jsoff_t i = 0; shift != 0 && i < pincap(js); i++) {
+    jsval_t val = loadval(js, pinslot(js, i));
+    if (vtype(val) == T_CFUNC)
+      saveval(js, pinslot(js, i), mkval(T_CFUNC, vdata(val) + shift));
+  }
+#endif
+#if JS_COMPILE
+  js->tks = js->tki = js->tkc = 0, js->tkgen++;  // Cached streams point to code
+#endif
+#if JS_ICACHE
+  if (js->ics) icflush(js);  // Cache is keyed by code pointers
+#endif
+  return js;
+}
+
+// Clone is a snapshot that gets restored right away: one copy of used memory
+struct js *js_clone(struct js *tmpl, void *buf, size_t len) {
+  if (len < sizeof(*tmpl) + tmpl->brk || (void *) tmpl == buf) return NULL;
+  js_snapshot(tmpl, buf, len);
+  struct js *js = js_restore(buf, len);
+#if JS_CODEREGS
+  if (js != NULL && js->regs != 0)  // Same process, so regions are still valid
+    memcpy(&js->mem[js->regs + sizeof(jsoff_t)],
+           &tmpl->mem[tmpl->regs + sizeof(jsoff_t)], JS_CODEREGS * REGREC);
+#endif
+  return js;
+}
+
+bool js_reset_to(struct js *js, struct js *tmpl) {
+  return js_clone(tmpl, js, sizeof(*js) + js->size) != NULL;
+}
+
+#if JS_CODEREGS
+bool js_addcode(struct js *js, const char *buf, size_t len) {
+  if (js->regs == 0) {  // Create the table on first use
+    jsval_t t = mkstr(js, NULL, JS_CODEREGS * REGREC);
+    if (is_err(t)) return false;
+    js->regs = (jsoff_t) vdata(t);
+    memset(&js->mem[js->regs + sizeof(jsoff_t)], 0, JS_CODEREGS * REGREC);
+  }
+  for (int i = 0; i < JS_CODEREGS; i++) {
+    jsoff_t n, rec = js->regs + (jsoff_t) sizeof(n) + (jsoff_t) i * REGREC;
+    const char *base = regbase(js, i, &n);
+    if (base != NULL && base != buf) continue;
+    if (base == NULL && n != 0 && n != len) return false;  // Rebind by index
+    memcpy(&js->mem[rec], &buf, sizeof(buf));
+    saveoff(js, rec + 8, (jsoff_t) len);
+    return true;
+  }
+  return false;
+}
+#endif
+
+jsval_t js_mkfun_typed(struct js *js, const struct jsfun *f) {
+  const char *p = f->sig;
+  uintptr_t ptr = (uintptr_t) f;
+  while (*p != '\0' && strchr("dibsj", *p) != NULL) p++;
+  if (p - f->sig > TF_MAX || p[0] != '>' || p[1] == '\0' ||
+      strchr("dibsjv", p[1]) == NULL || p[2] != '\0' ||
+      (uint64_t) ptr >> 47U != 0)
+    return js_mkerr(js, "bad signature");
+  return mkval(T_CFUNC, (uint64_t) 1 << 47U | ptr);
+}
+
+#if JS_PINS
+int js_pin(struct js *js, jsval_t val) {
+  jsoff_t i, cap = pincap(js);
+  for (i = 0; i < cap; i++) {
+    if (loadval(js, pinslot(js, i)) == PIN_FREE) break;
+  }
+  if (i == cap) {  // Table is full, or not created yet. Make a bigger one
+    jsoff_t n = cap == 0 ? PIN_MIN : cap * 2, old = js->pins;
+    jsval_t t = mkstr(js, NULL, sizeof(n) + n * sizeof(jsval_t));
+    if (is_err(t)) return -1;
+    js->pins = (jsoff_t) vdata(t);
+    saveoff(js, js->pins + (jsoff_t) sizeof(n), n);
+    if (old != 0)
+      memmove(&js->mem[pinslot(js, 0)], &js->mem[old + sizeof(old) * 2],
+              cap * sizeof(jsval_t));
+    for (jsoff_t j = cap; j < n; j++) saveval(js, pinslot(js, j), PIN_FREE);
+  }
+  saveval(js, pinslot(js, i), val);
+#if JS_INCGC
+  js_wb(js, val);
+#endif
+  return (int) i;
+}
+
+jsval_t js_pinned(struct js *js, int handle) {
+  if (handle < 0 || (jsoff_t) handle >= pincap(js)) return js_mkundef();
+  jsval_t v = loadval(js, pinslot(js, (jsoff_t) handle));
+  return v == PIN_FREE ? js_mkundef() : v;
+}
+
+void js_unpin(struct js *js, int handle) {
+  if (handle < 0 || (jsoff_t) handle >= pincap(js)) return;
+  saveval(js, pinslot(js, (jsoff_t) handle), PIN_FREE);
+}
+#endif
+
 // clang-format off
 void js_setgct(struct js *js, size_t gct) { js->gct = (jsoff_t) gct; }
 void js_setmaxcss(struct js *js, size_t max) { js->maxcss = (jsoff_t) max; }
@@ -1345,16 +3984,151 @@ int js_getbool(jsval_t value) { return vdata(value) & 1 ? 1 : 0; }
 jsval_t js_glob(struct js *js) { (void) js; return mkval(T_OBJ, 0); }
 
 void js_set(struct js *js, jsval_t obj, const char *key, jsval_t val) {
-  if (vtype(obj) == T_OBJ) setprop(js, obj, js_mkstr(js, key, strlen(key)), val);
+  if (vtype(obj) != T_OBJ) return;
+  size_t n = strlen(key);
+  jsoff_t off = lkp(js, obj, key, n);
+  if (off != 0) {
+    assign(js, mkval(T_PROP, off), val);  // Existing key, update in place
+  } else {
+    setprop(js, obj, mkkey(js, key, n), val);
+  }
 }
 
 char *js_getstr(struct js *js, jsval_t value, size_t *len) {
   if (vtype(value) != T_STR) return NULL;
-  jsoff_t n, off = vstr(js, value, &n);
+#if JS_ROPE
+  if (is_err(value = strflat(js, value))) return NULL;
+#endif
+  if (is_sstr(value) && is_err(value = unshort(js, value)))
+    return NULL;  // Needs JS memory
+  jsoff_t n;
+  const char *p = strptr(js, value, &n);  // External strings are as is
   if (len != NULL) *len = n;
-  return (char *) &js->mem[off];
+  return (char *) p;
+}
+
+jsval_t js_get(struct js *js, jsval_t obj, const char *key) {
+  if (vtype(obj) != T_OBJ) return js_mkundef();
+  jsoff_t off = lkp(js, obj, key, strlen(key));
+  return off == 0 ? js_mkundef() : resolveprop(js, mkval(T_PROP, off));
+}
+
+bool js_next(struct js *js, jsval_t obj, size_t *pos, jsval_t *key,
+             jsval_t *val) {
+  jsoff_t off = (jsoff_t) vdata(obj);
+#if JS_ARRAY
+  if (vtype(obj) == T_ARR) {  // Position is the next element index
+    if (*pos >= arrlen(loadoff(js, off))) return false;
+    if (key != NULL) *key = tov((double) *pos);
+    if (val != NULL) *val = loadval(js, arrslot(js, off, (jsoff_t) *pos));
+    *pos += 1;
+    return true;
+  }
+#endif
+#if JS_MAP
+  if (vtype(obj) == T_MAP) {  // Position is the next slot index
+    jsoff_t w = loadoff(js, off), i = *pos == 0 ? MAP_HDR : (jsoff_t) *pos;
+    if (loadoff(js, off + (jsoff_t) sizeof(off)) == 0) return false;
+    for (; i < arrlen(w); i += mapstride(w)) {
+      jsval_t k = loadval(js, arrslot(js, off, i));
+      if (vtype(k) == T_UNDEF) continue;  // Free or deleted slot
+      if (key != NULL) *key = k;
+      jsoff_t st = mapstride(w);  // Set elements have no value, return key
+      if (val != NULL) *val = loadval(js, arrslot(js, off, i + st - 1));
+      *pos = i + st;
+      return true;
+    }
+    return false;
+  }
+#endif
+  if (vtype(obj) != T_OBJ) return false;
+  // Position is the offset of the last returned property
+  off = *pos == 0 ? loadoff(js, off) & ~3U : loadoff(js, (jsoff_t) *pos) & ~3U;
+  for (; off != 0 && off < js->brk; off = loadoff(js, off) & ~3U) {
+    jsoff_t koff = loadoff(js, (jsoff_t) (off + sizeof(off)));
+    if (koff == 0) continue;  // Property index, see mkidx()
+    if (key != NULL) *key = mkval(T_STR, koff);
+    if (val != NULL) *val = resolveprop(js, mkval(T_PROP, off));
+    *pos = off;
+    return true;
+  }
+  return false;
+}
+
+int js_unpack(struct js *js, jsval_t obj, const char *schema, ...) {
+  int n = 0;
+  va_list ap;
+  va_start(ap, schema);
+  while (*schema != '\0') {
+    const char *name = schema, *colon = strchr(schema, ':');
+    if (colon == NULL || colon == name || colon[1] == '\0' ||
+        (colon[2] != ',' && colon[2] != '\0')) {
+      n = -1;  // Malformed schema
+      break;
+    }
+    char type = colon[1];
+    void *p = va_arg(ap, void *);
+    schema = colon[2] == ',' ? colon + 3 : colon + 2;
+    if (type != 'd' && type != 'b' && type != 's' && type != 'j') {
+      n = -1;  // Unknown type
+      break;
+    }
+    size_t len = (size_t) (colon - name);
+    jsoff_t off = vtype(obj) == T_OBJ ? lkp(js, obj, name, len) : 0;
+    if (off == 0) continue;  // Missing field, leave C value as is
+    jsval_t v = resolveprop(js, mkval(T_PROP, off));
+    if (type == 'd' && vtype(v) == T_NUM) {
+      *(double *) p = tod(v), n++;
+    } else if (type == 'b' && vtype(v) == T_BOOL) {
+      *(bool *) p = vdata(v) & 1, n++;
+    } else if (type == 's' && vtype(v) == T_STR) {
+      char *s = js_getstr(js, v, NULL);
+      if (s != NULL) *(char **) p = s, n++;
+    } else if (type == 'j') {
+      *(jsval_t *) p = v, n++;
+    }
+  }
+  va_end(ap);
+  return n;
 }
 
+#if JS_TYPED
+jsval_t js_mktyped(struct js *js, void *ptr, size_t len, int type) {
+  jsoff_t hdr[] = {(jsoff_t) type, (jsoff_t) len, 0, 0};
+  size_t n = TA_HDR;
+  if (type < JS_INT8 || type > JS_FLOAT64 || (jsoff_t) len != len ||
+      (ptr == NULL && len > js->size))
+    return js_mkerr(js, "bad typed array");
+  if (ptr == NULL) n += len * tasizes[type];  // Elements live in JS memory
+  jsval_t v = mkstr(js, NULL, n);
+  if (is_err(v)) return v;
+  memcpy(&hdr[2], &ptr, sizeof(ptr));
+  memcpy(&js->mem[vdata(v) + sizeof(jsoff_t)], hdr, sizeof(hdr));
+  memset(&js->mem[vdata(v) + sizeof(jsoff_t) + TA_HDR], 0, n - TA_HDR);
+  return mkval(T_TYPED, vdata(v));
+}
+
+void *js_gettyped(struct js *js, jsval_t val, size_t *len, int *type) {
+  if (vtype(val) != T_TYPED) return NULL;
+  if (len != NULL) *len = talen(js, (jsoff_t) vdata(val));
+  if (type != NULL) *type = tatype(js, (jsoff_t) vdata(val));
+  return taptr(js, (jsoff_t) vdata(val));
+}
+#endif
+
+#if JS_EXTSTR
+jsval_t js_mkstr_ext(struct js *js, const void *ptr, size_t len,
+                     void (*free_cb)(void *)) {
+  uint8_t buf[16] = {0};
+  if (len > 0x7ffffffU) return js_mkerr(js, "string too long");
+  memcpy(buf, &ptr, sizeof(ptr));
+  memcpy(buf + 8, &free_cb, sizeof(free_cb));
+  jsval_t v = mkentity(js, ARRBIT | EXTBIT | (jsoff_t) len << 2 | T_ROPE, buf,
+                       sizeof(buf));
+  return is_err(v) ? v : mkval(T_STR, vdata(v));
+}
+#endif
+
 int js_type(jsval_t val) {
   switch (vtype(val)) {  
     case T_UNDEF:   return JS_UNDEF;
@@ -1394,12 +4168,40 @@ jsval_t js_eval(struct js *js, const char *buf, size_t len) {
   js->clen = (jsoff_t) len;
   js->pos = 0;
   js->cstk = &res;
+#if JS_COMPILE
+  jsoff_t tks = js->tks, tki = js->tki, size = js->size, gen = js->tkgen;
+  js_tkload(js);
+  js->pos = 0, js->consumed = 1, js->tok = TOK_ERR;
+#endif
   while (next(js) != TOK_EOF && !is_err(res)) {
     res = js_stmt(js);
   }
+#if JS_COMPILE
+  if (js->tkgen != gen && tks < size) tks = 0;  // Caller's stream is GC-ed
+  js->tks = tks, js->tki = tki, js->size = size;  // Pop our token stream
+#endif
   return res;
 }
 
+jsval_t js_call(struct js *js, jsval_t func, jsval_t *args, int nargs) {
+  if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC)
+    return js_mkerr(js, "calling non-function");
+  if (nargs < 0 || (args == NULL && nargs > 0)) return js_mkerr(js, "bad args");
+  if (nargs == 0) return callfn(js, func, 0);
+  jsoff_t f = argpush(js, func), n = (jsoff_t) nargs;
+  if (f == 0 || js->brk + n * sizeof(func) > js->size) {
+    if (f != 0) argpop(js, f);
+    return js_mkerr(js, "call oom");
+  }
+  js->size -= n * (jsoff_t) sizeof(func);  // Arguments go to the frame
+  if (n > 0) memcpy(&js->mem[js->size], args, n * sizeof(func));
+  saveoff(js, f + 4, n + 1);
+#if JS_INCGC
+  for (int i = 0; i < nargs; i++) js_wb(js, args[i]);
+#endif
+  return callfn(js, func, f);
+}
+
 #ifdef JS_DUMP
 void js_dump(struct js *js) {
   jsoff_t off = 0, v;
@@ -1419,6 +4221,15 @@ void js_dump(struct js *js) {
     } else if ((v & 3) == T_STR) {
       jsoff_t len = offtolen(v);
       printf("STR %u [%.*s]\n", len, (int) len, js->mem + off + sizeof(v));
+    } else if (is_ext(v)) {
+      printf("EXT %u\n", extlen(v));
+    } else if ((v & 3) == T_ROPE && (v & ARRBIT)) {
+      printf("ARR %u, vec %u\n", (v >> 2) & 0x3ffffffU,
+             loadoff(js, (jsoff_t) (off + sizeof(v))));
+    } else if ((v & 3) == T_ROPE) {
+      printf("ROPE %u, left %u right %u\n", offtolen(v),
+             loadoff(js, (jsoff_t) (off + sizeof(v))),
+             loadoff(js, (jsoff_t) (off + sizeof(v) * 2)));
     } else {
       printf("???\n");
       break;
@@ -38,6 +38,11 @@ void js_setmaxcss(struct js *, size_t);              // Set max C stack size
 void js_setgct(struct js *, size_t);                 // Set GC trigger threshold
 void js_stats(struct js *, size_t *total, size_t *min, size_t *cstacksize);
 void js_dump(struct js *);  // Print debug info. Requires -DJS_DUMP
+size_t js_snapshot(struct js *, void *buf, size_t len);  // Save JS instance
+struct js *js_restore(void *buf, size_t len);            // Load JS instance
+struct js *js_clone(struct js *, void *buf, size_t len);  // Copy JS instance
+bool js_reset_to(struct js *, struct js *tmpl);          // Copy tmpl into js
+jsval_t js_call(struct js *, jsval_t func, jsval_t *args, int nargs);  // Call
 
 // Create JS values from C values
 jsval_t js_mkundef(void);  // Create undefined
@@ -51,6 +56,52 @@ jsval_t js_mkfun(jsval_t (*fn)(struct js *, jsval_t *, int));  // Create func
 jsval_t js_mkobj(struct js *);                                 // Create object
 void js_set(struct js *, jsval_t, const char *, jsval_t);      // Set obj attr
 
+// Typed C function. Arguments are checked and converted before the call,
+// and the result is converted after it, as described by signature: argument
+// types, '>', result type. Types are: d double, i int, b bool, s string (not
+// 0-terminated), j any value, v no result (undefined). E.g. "dd>d" is
+// double f(double, double). struct jsfun must stay valid while JS uses it
+typedef union {
+  double d;
+  int i;
+  bool b;
+  struct {
+    const char *ptr;
+    size_t len;
+  } s;
+  jsval_t j;
+} jsarg_t;
+struct jsfun {
+  jsarg_t (*fn)(struct js *, jsarg_t *args);  // Function
+  const char *sig;                            // Signature, e.g. "dd>d"
+};
+jsval_t js_mkfun_typed(struct js *, const struct jsfun *);
+
+// Typed arrays, require -DJS_TYPED=1. If ptr is NULL, elements are allocated
+// in JS memory. Otherwise, they are read and written in place at ptr, and
+// snapshots hold ptr, so they can be restored in the same process only
+enum { JS_INT8, JS_UINT8, JS_INT16, JS_UINT16, JS_INT32, JS_UINT32, JS_FLOAT32,
+       JS_FLOAT64 };
+jsval_t js_mktyped(struct js *, void *ptr, size_t len, int type);
+void *js_gettyped(struct js *, jsval_t, size_t *len, int *type);
+
+// External string, requires -DJS_EXTSTR=1. String bytes are not copied, and
+// must stay valid until GC calls free_cb(ptr). free_cb can be NULL. Snapshots
+// hold ptr, not the bytes, so they can be restored in the same process only
+jsval_t js_mkstr_ext(struct js *, const void *ptr, size_t len,
+                     void (*free_cb)(void *));
+
+// Register code region, requires -DJS_CODEREGS=N. Functions defined in the
+// region reference their source instead of copying it to JS memory. After
+// js_restore(), register the same regions again, in the same order
+bool js_addcode(struct js *, const char *buf, size_t len);
+
+// Pin value, requires -DJS_PINS=1. Pinned values survive GC, and GC keeps
+// them up to date. Returns a handle, or -1 if there is no memory
+int js_pin(struct js *, jsval_t val);
+jsval_t js_pinned(struct js *, int handle);  // Get pinned value, or undefined
+void js_unpin(struct js *, int handle);      // Let GC collect the value
+
 // Extract C values from JS values
 enum { JS_UNDEF, JS_NULL, JS_TRUE, JS_FALSE, JS_STR, JS_NUM, JS_ERR, JS_PRIV };
 int js_type(jsval_t val);       // Return JS value type
@@ -58,6 +109,17 @@ double js_getnum(jsval_t val);  // Get number
 int js_getbool(jsval_t val);    // Get boolean, 0 or 1
 char *js_getstr(struct js *js, jsval_t val, size_t *len);  // Get string
 
+// Read object properties. js_get() returns undefined for missing properties.
+// js_next() iterates over object properties, array elements or Map/Set
+// entries: start with *pos = 0, returns false when done. js_unpack() reads
+// fields described by schema "name:t,..." where t is d (double *),
+// b (bool *), s (char **) or j (jsval_t *). Missing or mismatched fields are
+// left untouched. Returns the number of fields read, or -1 on a bad schema.
+// Like js_getstr(), s can allocate: short strings and ropes are copied
+jsval_t js_get(struct js *, jsval_t obj, const char *key);
+bool js_next(struct js *, jsval_t obj, size_t *pos, jsval_t *key, jsval_t *v);
+int js_unpack(struct js *, jsval_t obj, const char *schema, ...);
+
 #ifdef __cplusplus
 }
 #endif
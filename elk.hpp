@@ -0,0 +1,292 @@
+// Copyright (c) 2013-2022 Cesanta Software Limited
+// All rights reserved
+//
+// This software is dual-licensed: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation. For the terms of this
+// license, see http://www.fsf.org/licensing/licenses/agpl-3.0.html
+//
+// You are free to use this software under the terms of the GNU General
+// Public License, but WITHOUT ANY WARRANTY; without even the implied
+// warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// Alternatively, you can license this software under a commercial
+// license, please contact us at https://cesanta.com/contact.html
+
+// C++ bindings for Elk, require C++17. Native functions are bound by their
+// signatures: argument checks and conversions are generated at compile time
+//
+//   static double add(double a, double b) { return a + b; }
+//   elk::isolate js(4096);
+//   js.def<add>("add");
+//   double v = 0;
+//   js.get(js.eval("add(1, 2)"), v);  // v is 3
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "elk.h"
+
+namespace elk {
+
+// JS value of any type. jsval_t is uint64_t, so a plain jsval_t argument or
+// result is converted as a number. Use value to pass JS values as is
+struct value {
+  jsval_t v;
+  value(jsval_t x = js_mkundef()) : v(x) {}
+  operator jsval_t() const { return v; }
+};
+
+namespace detail {
+
+// Conversion between JS and C++ values. get() returns false if the JS value
+// has a different type, make() creates a JS value. Unsupported types do not
+// compile
+template <typename T, typename = void>
+struct conv;
+
+template <>
+struct conv<value> {
+  static bool get(struct js *, jsval_t v, value &out) {
+    out = v;
+    return true;
+  }
+  static jsval_t make(struct js *, value v) { return v; }
+};
+
+template <>
+struct conv<bool> {
+  static bool get(struct js *, jsval_t v, bool &out) {
+    if (js_type(v) != JS_TRUE && js_type(v) != JS_FALSE) return false;
+    out = js_type(v) == JS_TRUE;
+    return true;
+  }
+  static jsval_t make(struct js *, bool b) {
+    return b ? js_mktrue() : js_mkfalse();
+  }
+};
+
+template <typename T>
+struct conv<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static bool get(struct js *, jsval_t v, T &out) {
+    if (js_type(v) != JS_NUM) return false;
+    out = static_cast<T>(js_getnum(v));
+    return true;
+  }
+  static jsval_t make(struct js *, T d) {
+    return js_mknum(static_cast<double>(d));
+  }
+};
+
+// Integers: numbers out of range do not convert. Both range limits are
+// powers of 2, thus exact doubles
+template <typename T>
+struct conv<T, std::enable_if_t<std::is_integral_v<T> &&
+                                !std::is_same_v<T, bool>>> {
+  static bool get(struct js *, jsval_t v, T &out) {
+    using lim = std::numeric_limits<T>;
+    constexpr double hi = static_cast<double>(lim::max() / 2 + 1) * 2;
+    constexpr double lo = static_cast<double>(lim::min());
+    double d = js_getnum(v);
+    if (js_type(v) != JS_NUM || !(d >= lo && d < hi)) return false;
+    out = static_cast<T>(d);
+    return true;
+  }
+  static jsval_t make(struct js *, T i) {
+    return js_mknum(static_cast<double>(i));
+  }
+};
+
+// String views point to JS memory, and are valid until the next GC
+template <>
+struct conv<std::string_view> {
+  static bool get(struct js *js, jsval_t v, std::string_view &out) {
+    size_t len = 0;
+    const char *p = js_getstr(js, v, &len);
+    if (p == nullptr) return false;
+    out = std::string_view(p, len);
+    return true;
+  }
+  static jsval_t make(struct js *js, std::string_view s) {
+    return js_mkstr(js, s.data(), s.size());
+  }
+};
+
+template <>
+struct conv<std::string> {
+  static bool get(struct js *js, jsval_t v, std::string &out) {
+    std::string_view s;
+    if (!conv<std::string_view>::get(js, v, s)) return false;
+    out.assign(s.data(), s.size());
+    return true;
+  }
+  static jsval_t make(struct js *js, const std::string &s) {
+    return js_mkstr(js, s.data(), s.size());
+  }
+};
+
+// Only as a result: JS strings are not necessarily 0-terminated
+template <>
+struct conv<const char *> {
+  static jsval_t make(struct js *js, const char *s) {
+    return s == nullptr ? js_mknull() : js_mkstr(js, s, std::strlen(s));
+  }
+};
+
+template <typename T>
+using conv_t = conv<std::decay_t<T>>;
+
+// Native function trampoline: check and convert arguments, call F, convert
+// the result. If J is true, F takes struct js * as the first argument
+template <auto F, bool J, typename R, typename... A>
+struct trampoline {
+  template <size_t... I>
+  static R call(struct js *js, std::tuple<std::decay_t<A>...> &v,
+                std::index_sequence<I...>) {
+    (void) js, (void) v;
+    if constexpr (J) {
+      return F(js, std::move(std::get<I>(v))...);
+    } else {
+      return F(std::move(std::get<I>(v))...);
+    }
+  }
+
+  template <size_t... I>
+  static jsval_t run(struct js *js, jsval_t *args, std::index_sequence<I...>) {
+    std::tuple<std::decay_t<A>...> v;
+    int bad = 0;
+    (void) args;
+    ((bad = bad == 0 && !conv_t<A>::get(js, args[I], std::get<I>(v))
+                ? static_cast<int>(I) + 1
+                : bad),
+     ...);
+    if (bad != 0) return js_mkerr(js, "bad arg %d", bad);
+    auto seq = std::index_sequence<I...>{};
+    if constexpr (std::is_void_v<R>) {
+      call(js, v, seq);
+      return js_mkundef();
+    } else {
+      return conv_t<R>::make(js, call(js, v, seq));
+    }
+  }
+
+  static jsval_t fn(struct js *js, jsval_t *args, int nargs) {
+    if (nargs != static_cast<int>(sizeof...(A)))
+      return js_mkerr(js, "%d args expected", static_cast<int>(sizeof...(A)));
+    return run(js, args, std::index_sequence_for<A...>{});
+  }
+};
+
+template <auto F, typename S = decltype(F)>
+struct native;
+
+template <auto F, typename R, typename... A>
+struct native<F, R (*)(A...)> : trampoline<F, false, R, A...> {};
+
+template <auto F, typename R, typename... A>
+struct native<F, R (*)(struct js *, A...)> : trampoline<F, true, R, A...> {};
+
+}  // namespace detail
+
+// Make a JS function from C++ function F. F can take struct js * as the
+// first argument, then any number of bool, number, std::string,
+// std::string_view or value arguments
+template <auto F>
+jsval_t function() {
+  return js_mkfun(detail::native<F>::fn);
+}
+
+// Convert JS value to C++ value. Return false if types do not match
+template <typename T>
+bool get(struct js *js, jsval_t v, T &out) {
+  return detail::conv<T>::get(js, v, out);
+}
+
+// Pinned JS value, requires -DJS_PINS=1. It survives GC until the handle is
+// destroyed, and must not outlive its instance
+class handle {
+ public:
+  handle() = default;
+  handle(struct js *js, jsval_t v) : js_(js), h_(js_pin(js, v)) {}
+  handle(handle &&o) noexcept : js_(o.js_), h_(o.h_) { o.h_ = -1; }
+  handle &operator=(handle &&o) noexcept {
+    if (this != &o) {
+      reset();
+      js_ = o.js_, h_ = o.h_, o.h_ = -1;
+    }
+    return *this;
+  }
+  handle(const handle &) = delete;
+  handle &operator=(const handle &) = delete;
+  ~handle() { reset(); }
+
+  jsval_t get() const { return h_ < 0 ? js_mkundef() : js_pinned(js_, h_); }
+  explicit operator bool() const { return h_ >= 0; }
+  void reset() {
+    if (h_ >= 0) js_unpin(js_, h_);
+    h_ = -1;
+  }
+
+ private:
+  struct js *js_ = nullptr;
+  int h_ = -1;
+};
+
+// JS instance. Owns its memory if created with a size
+class isolate {
+ public:
+  explicit isolate(size_t len)
+      : mem_(new char[len]), js_(js_create(mem_.get(), len)) {}
+  isolate(void *buf, size_t len) : js_(js_create(buf, len)) {}
+  isolate(isolate &&o) noexcept : mem_(std::move(o.mem_)), js_(o.js_) {
+    o.js_ = nullptr;
+  }
+  isolate &operator=(isolate &&o) noexcept {
+    if (this != &o) mem_ = std::move(o.mem_), js_ = o.js_, o.js_ = nullptr;
+    return *this;
+  }
+  isolate(const isolate &) = delete;
+  isolate &operator=(const isolate &) = delete;
+
+  struct js *get() const { return js_; }
+  explicit operator bool() const { return js_ != nullptr; }
+  jsval_t glob() const { return js_glob(js_); }
+  jsval_t eval(std::string_view code) {
+    return js_eval(js_, code.data(), code.size());
+  }
+  const char *str(jsval_t v) { return js_str(js_, v); }
+  void set(jsval_t obj, const char *name, jsval_t v) {
+    js_set(js_, obj, name, v);
+  }
+  template <auto F>
+  void def(const char *name) {
+    js_set(js_, js_glob(js_), name, function<F>());
+  }
+  template <typename T>
+  bool get(jsval_t v, T &out) {
+    return elk::get(js_, v, out);
+  }
+  handle pin(jsval_t v) { return handle(js_, v); }
+
+  // Call JS or C function with C++ arguments
+  template <typename... A>
+  jsval_t call(jsval_t fn, const A &...a) {
+    jsval_t args[] = {detail::conv_t<A>::make(js_, a)..., js_mkundef()};
+    return js_call(js_, fn, args, static_cast<int>(sizeof...(A)));
+  }
+
+ private:
+  std::unique_ptr<char[]> mem_;
+  struct js *js_ = nullptr;
+};
+
+}  // namespace elk
@@ -1,6 +1,54 @@
 #include <time.h>
 #define JS_DUMP
+#ifndef JS_COMPILE
+#define JS_COMPILE 1
+#endif
+#ifndef JS_ATOMS
+#define JS_ATOMS 1
+#endif
+#ifndef JS_INDEX
+#define JS_INDEX 1
+#endif
+#ifndef JS_ICACHE
+#define JS_ICACHE 1
+#endif
+#ifndef JS_INCGC
+#define JS_INCGC 512
+#endif
+#ifndef JS_NURSERY
+#define JS_NURSERY 1024
+#endif
+#ifndef JS_ROPE
+#define JS_ROPE 1
+#endif
+#ifndef JS_SHORTSTR
+#define JS_SHORTSTR 1
+#endif
+#ifndef JS_DTOA
+#define JS_DTOA 1
+#endif
+#ifndef JS_ARRAY
+#define JS_ARRAY 1
+#endif
+#ifndef JS_TYPED
+#define JS_TYPED 1
+#endif
+#ifndef JS_EXTSTR
+#define JS_EXTSTR 1
+#endif
+#ifndef JS_CODEREGS
+#define JS_CODEREGS 4
+#endif
+#ifndef JS_MAP
+#define JS_MAP 1
+#endif
+#ifndef JS_PINS
+#define JS_PINS 1
+#endif
 #include "../elk.c"
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#include "../elk.hpp"
+#endif
 
 static bool ev(struct js *js, const char *expr, const char *expectation) {
   const char *result = js_str(js, js_eval(js, expr, strlen(expr)));
@@ -10,7 +58,7 @@ static bool ev(struct js *js, const char *expr, const char *expectation) {
 }
 
 static void test_arith(void) {
-  char mem[200];
+  char mem[sizeof(struct js) + 40];
   struct js *js;
   assert((js = js_create(NULL, 0)) == NULL);
   assert((js = js_create(mem, 0)) == NULL);
@@ -45,7 +93,7 @@ static void test_arith(void) {
   assert(ev(js, "~5", "-6"));
   assert(ev(js, "6 / - - 2", "3"));
   assert(ev(js, "7+~5", "1"));
-  assert(ev(js, "5/3", "1.66667"));
+  assert(ev(js, "5/3", JS_DTOA ? "1.6666666666666667" : "1.66667"));
   assert(ev(js, "0x64", "100"));
 #ifndef JS32
   assert(ev(js, "0x7fffffff", "2147483647"));
@@ -56,15 +104,15 @@ static void test_arith(void) {
   assert(ev(js, "6 & 3", "2"));
   assert(ev(js, "6 | 3", "7"));
   assert(ev(js, "6 ^ 3", "5"));
-  assert(ev(js, "0.1 + 0.2", "0.3"));
+  assert(ev(js, "0.1 + 0.2", JS_DTOA ? "0.30000000000000004" : "0.3"));
   assert(ev(js, "123.4 + 0.1", "123.5"));
   // assert(ev(js, "2**3", "8"));
   // assert(ev(js, "1.2**3.4", "1.85873"));
 }
 
 static void test_errors(void) {
-  char mem[200];
   struct js *js;
+  char mem[sizeof(*js) + 80];
   assert((js = js_create(mem, sizeof(mem))) != NULL);
   js_setmaxcss(js, 5000);
   assert(ev(js, "1+(((((((((((((((((1)))))))))))))))))", "ERROR: C stack"));
@@ -528,6 +576,36 @@ static jsval_t js_gt(struct js *js, jsval_t *args, int nargs) {
   return js_getnum(args[0]) > js_getnum(args[1]) ? js_mktrue() : js_mkfalse();
 }
 
+static void test_gc_compact(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 3000], buf[20];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  js_setgct(js, sizeof(mem));  // No automatic GC
+  for (int i = 0; i < 20; i++) {  // Interleave garbage and live entities
+    js_mkstr(js, NULL, 7 + (size_t) i);  // Garbage
+    jsval_t obj = js_mkobj(js);
+    snprintf(buf, sizeof(buf), "o%d", i);
+    js_set(js, js_glob(js), buf, obj);
+    js_mkobj(js);
+    js_set(js, obj, "v", js_mknum(i));
+    js_set(js, obj, "s", js_mkstr(js, buf, strlen(buf)));
+  }
+  for (size_t n = 64;; n /= 2) {  // Fill memory up, leave no room for GC
+    while (vtype(js_mkstr(js, NULL, n)) == T_STR) (void) 0;
+    if (n == 0) break;
+  }
+  assert(js->size - js->brk < 8);
+  js_gc(js);  // Both break table and mark stack overflow
+  assert(js->size - js->brk > 1000);
+  assert(ev(js, "o0.v + o19.v + o7.v", "26"));
+  assert(ev(js, "o13.s", "\"o13\""));
+  js_gc(js);
+  jsoff_t brk = js->brk;
+  js_gc(js);
+  assert(js->brk == brk);  // Nothing to collect
+  assert(ev(js, "o3.s + o19.s", "\"o3o19\""));
+}
+
 static void test_c_funcs(void) {
   struct js *js;
   char mem[sizeof(*js) + 1800];
@@ -593,6 +671,1093 @@ static void test_ternary(void) {
   assert(ev(js, "f(10)", "3628800"));
 }
 
+static void test_compile(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 4000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsoff_t size = js->size;
+  assert(ev(js, "let a = 0, i = 0; for (; i < 100; i++) a += i; a", "4950"));
+  assert(ev(js, "let f = function(x) { return x < 2 ? 1 : x * f(x - 1); };",
+            "undefined"));
+  assert(ev(js, "a = 0; for (i = 0; i < 5; i++) a += f(i); a", "34"));
+  assert(ev(js, "a = 0; for (i = 0; i < 5; i++) { if (i > 2) break; a++; } a",
+            "3"));
+  assert(ev(js, "'x' + 'y'; 1 +", "ERROR: bad expr"));
+  assert(ev(js, "1 + @", "ERROR: parse error"));
+#if JS_COMPILE
+  js_gc(js);
+  assert(js->tkc == 0);  // GC flushes the cache
+  assert(ev(js, "f(3)", "6"));
+  assert(js->tkc != 0);  // Function body is cached
+  jsoff_t tkc = js->tkc, brk = js->brk;
+  assert(ev(js, "f(4) + f(3)", "30"));
+  assert(js->tkc == tkc);  // Cache hit, no new streams
+  assert(ev(js, "f(4)", "24"));
+  js_gc(js);
+  assert(js->tkc == 0 && js->brk < brk);
+#endif
+  assert(js->size == size);  // All token streams are popped
+#if JS_COMPILE
+  assert(js->tks == 0);
+  js->code = "1 + 2; /* */", js->clen = 12, js->pos = 0;
+  js_compile(js);
+  assert(js->tks != 0 && loadoff(js, js->tks + 12) == 4);
+  js->size = size, js->tks = 0;
+#endif
+}
+
+static void test_atoms(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let o = {x: 1, y: 2}, x = 3; o.x + o.y + x", "6"));
+  assert(ev(js, "let f = function(x, y) { return x + y; }; f(1, 2)", "3"));
+  assert(ev(js, "o = {'x': 5, y: 6}; o.x + o.y", "11"));
+  assert(ev(js, "o", "{\"y\":6,\"x\":5}"));
+  assert(ev(js, "f(3, 4)", "7"));
+  jsoff_t brk = js->brk;
+  assert(ev(js, "f(3, 4)", "7"));
+#if JS_ATOMS
+  assert(js->brk - brk == 8 + 16 * 2 + 8);  // Scope, x, y, js_str() result
+#else
+  (void) brk;
+#endif
+  for (int i = 0; i < 30; i++) {  // Grow atom table
+    char buf[20];
+    snprintf(buf, sizeof(buf), "k%d", i);
+    js_set(js, js_glob(js), buf, js_mknum(i));
+  }
+  assert(ev(js, "k0 + k29 + x", "32"));
+  assert(ev(js, "o.z", "undefined"));
+  assert(ev(js, "zz", "ERROR: 'zz' not found"));
+  js_gc(js);
+  assert(ev(js, "k7 + o.y", "13"));
+#if JS_ATOMS
+  assert(js->atoms != 0);
+  assert(loadoff(js, js->atoms + 4) >= 64);
+  assert(atomfind(js, "x", 1) != 0);
+  assert(atomfind(js, "nope", 4) == 0);
+#endif
+}
+
+static void test_index(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000], buf[200];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  for (int i = 0; i < 20; i++) {  // Many globals, like imported C functions
+    snprintf(buf, sizeof(buf), "g%d", i);
+    js_set(js, js_glob(js), buf, js_mknum(i));
+  }
+  assert(ev(js, "g0 + g19", "19"));
+#if JS_INDEX
+  assert(isidx(js, loadoff(js, 0) & ~3U));  // Global scope is indexed now
+#endif
+  assert(ev(js, "let t = 0; for (let i = 0; i < 3; i++) t += g1 + g18; t",
+            "57"));
+  js_set(js, js_glob(js), "g5", js_mknum(50));  // Updates existing g5
+  assert(ev(js, "g5 + g6", "56"));
+  for (int i = 20; i < 100; i++) {  // Grow the index, make garbage
+    snprintf(buf, sizeof(buf), "g%d", i);
+    js_set(js, js_glob(js), buf, js_mknum(i));
+    js_eval(js, "'garbage' + 'string'", ~0U);
+  }
+  js_gc(js);  // Compact memory, property offsets change
+  assert(ev(js, "g0 + g5 + g19 + g20 + g99", "188"));
+  assert(ev(js, "g100", "ERROR: 'g100' not found"));
+  assert(ev(js, "let o = {a0: 0, a1: 1, a2: 2, a3: 3, a4: 4, a5: 5, a6: 6, "
+                "a7: 7, a8: 8, a9: 9, a10: 10, a11: 11, a12: 12, a13: 13, "
+                "a14: 14, a15: 15, a16: 16, a17: 17}; o.a0 + o.a17 + o.a9",
+            "26"));
+  assert(ev(js, "o.a3 = 30; o.a3 + o.a4", "34"));
+  assert(ev(js, "o.x", "undefined"));
+  assert(ev(js, "let p = {b: 1, a0: 0, a1: 1, a2: 2, a3: 3, a4: 4, a5: 5, "
+                "a6: 6, a7: 7, a8: 8, a9: 9, a10: 10, a11: 11, a12: 12, "
+                "a13: 13, a14: 14, a15: 15}; p.b + p.a0; p",
+            "{\"a15\":15,\"a14\":14,\"a13\":13,\"a12\":12,\"a11\":11,"
+            "\"a10\":10,\"a9\":9,\"a8\":8,\"a7\":7,\"a6\":6,\"a5\":5,"
+            "\"a4\":4,\"a3\":3,\"a2\":2,\"a1\":1,\"a0\":0,\"b\":1}"));
+}
+
+static void test_icache(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 12000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let x = 1, h = function() { return x; };", "undefined"));
+  assert(ev(js, "let g = function() { let x = 2; return h(); };", "undefined"));
+  assert(ev(js, "h() + g() * 10 + h() * 100", "121"));
+  assert(ev(js, "let t = 0; for (let i = 0; i < 3; i++) t += h() + g(); t",
+            "9"));
+  assert(ev(js, "let o = {a: 1}, p = {b: 3, a: 2}, q = {};", "undefined"));
+  assert(ev(js, "let f = function(v) { return v.a; };", "undefined"));
+  assert(ev(js, "t = 0; for (let i = 0; i < 4; i++) t += f(o) * 10 + f(p); t",
+            "48"));
+  assert(ev(js, "f(q)", "undefined"));
+  assert(ev(js, "t = 0; for (let i = 0; i < 3; i++) { t += x; let x = 5; } t",
+            "3"));
+  js_set(js, js_glob(js), "x", js_mknum(7));  // Updates existing x
+  assert(ev(js, "h() + x", "14"));
+  js_gc(js);
+  assert(ev(js, "h() + g() + f(o) + f(p)", "12"));
+  assert(ev(js, "o.a = 4; t = 0; for (let i = 0; i < 3; i++) t += o.a; t",
+            "12"));
+#if JS_ICACHE
+  const char *name = "x";
+  assert(js->ics != 0 && lookup(js, name, 1) != 0);
+  assert(icfind(js, name, 1, js->scope, true) != 0);   // Cached
+  assert(icfind(js, name, 1, js->scope, false) != 0);  // Global scope itself
+  js_set(js, js_glob(js), "x", js_mknum(8));
+  assert(icfind(js, name, 1, js->scope, true) != 0);  // Same x, still valid
+  assert(ev(js, "x", "8"));
+  assert(ev(js, "f(o)", "4"));
+  assert(ev(js, "delete o.a", "true"));
+  assert(ev(js, "f(o)", "undefined"));  // Cached o.a is deleted
+  js_gc(js);
+  assert(icfind(js, name, 1, js->scope, true) == 0);  // Flushed by GC
+#endif
+}
+
+static void test_incgc(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 6000];
+  int i, cycles = 0;
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let a = 0, b = 0, x = 0, n = 40, s = 'x';", "undefined"));
+  assert(ev(js, "for (let i = 0; i < n; i++) a = {next: a, v: i};",
+            "undefined"));
+  // Move list nodes from a to b and back, making garbage in the meantime
+  for (i = 0; i < 300; i++) {
+    const char *code =
+        "x = a; a = a.next; x.next = b; b = x; s = 'garbage' + s; n--;"
+        "if (n === 0) { a = b; b = 0; n = 40; s = 'x'; }";
+    js_eval(js, code, strlen(code));
+#if JS_INCGC
+    if (js->gcmap != 0) cycles++;
+#endif
+  }
+  const char *sum =
+      "let sum = 0; x = a; for (let i = 0; i < n; i++) "
+      "{ sum += x.v; x = x.next; } x = b; for (let i = n; i < 40; i++) "
+      "{ sum += x.v; x = x.next; } sum";
+  assert(ev(js, sum, "780"));
+#if JS_INCGC
+  assert(cycles > 0);
+  js_gc(js);
+  assert(js->gcmap == 0);  // Full GC cancels the cycle
+#else
+  (void) cycles;
+  js_gc(js);
+#endif
+  assert(ev(js, sum + 4, "780"));
+}
+
+static void test_nursery(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let a = {x: 1}, o = {n: 0, s: 'x'}, t;", "undefined"));
+  js_gc(js);
+  assert(ev(js, "a = 0;", "0"));  // Old garbage below o
+  jsval_t o = js_eval(js, "o", 1);
+  js_set(js, o, "y", js_mkstr(js, "hello", 5));  // Old o refers to new prop
+#if JS_NURSERY
+  int collections = 0;
+  assert(js->rset != 0);
+  jsoff_t young = loadoff(js, js->rset + 4);  // Nursery start
+#endif
+  for (int i = 0; i < 100; i++) {
+    const char *code = "o.n++; o.s = 'ab' + 'cd'; t = {z: o.s};";
+    assert(js_type(js_eval(js, code, strlen(code))) == JS_PRIV);
+#if JS_NURSERY
+    if (loadoff(js, js->rset + 4) != young) collections++;
+    young = loadoff(js, js->rset + 4);
+    assert(js->brk <= js->gct);        // No full GC
+    assert(js_eval(js, "o", 1) == o);  // Old entities do not move
+#endif
+  }
+  assert(ev(js, "o.n", "100"));
+  assert(ev(js, "o.s + o.y", "\"abcdhello\""));
+#if JS_NURSERY
+  assert(collections > 0);
+  js_gc(js);
+  assert(js_eval(js, "o", 1) != o);  // Full GC deletes old garbage
+#endif
+  assert(ev(js, "o.s + o.y", "\"abcdhello\""));
+}
+
+static void test_snapshot(void) {
+  struct js *js, *js2;
+  char mem[sizeof(*js) + 4000], snap[sizeof(mem)], mem2[sizeof(mem) + 1000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  js_set(js, js_glob(js), "gt", js_mkfun(js_gt));
+  assert(ev(js, "let o = {a: 1, s: 'x'}, f = function(x) { return x * 2; };",
+            "undefined"));
+  size_t n = js_snapshot(js, snap, sizeof(snap));
+  assert(n > sizeof(*js) && n <= sizeof(snap));
+  assert(js_snapshot(js, snap, n - 1) == n);  // Too small, nothing is copied
+  assert(ev(js, "o.a = 2; o.a", "2"));       // Does not affect the snapshot
+
+  // Restore into a larger buffer
+  memcpy(mem2, snap, n);
+  assert((js2 = js_restore(mem2, sizeof(mem2))) != NULL);
+  assert(ev(js2, "f(o.a)", "2"));
+  assert(ev(js2, "gt(f(2), 3)", "true"));
+  assert(ev(js2, "o.s + 'y'", "\"xy\""));
+  assert(ev(js, "o.a", "2"));
+
+  // Restore in place, again. Memory must fit all data
+  assert(js_restore(snap, n - 1) == NULL);
+  assert((js2 = js_restore(snap, sizeof(snap))) != NULL);
+  assert(ev(js2, "o.a + f(3)", "7"));
+  js_gc(js2);
+  assert(ev(js2, "let z = o; gt(z.a, 0)", "true"));
+}
+
+static void test_clone(void) {
+  struct js *tmpl, *js, *js2;
+  char mem[sizeof(*tmpl) + 3000], mem2[sizeof(mem)], mem3[sizeof(mem)];
+  assert((tmpl = js_create(mem, sizeof(mem))) != NULL);
+  js_set(tmpl, js_glob(tmpl), "gt", js_mkfun(js_gt));
+  assert(ev(tmpl, "let n = 0, inc = function() { n++; return n; };",
+            "undefined"));
+  assert((js = js_clone(tmpl, mem2, sizeof(mem2))) != NULL);
+  assert((js2 = js_clone(tmpl, mem3, sizeof(mem3))) != NULL);
+  assert(ev(js, "inc(); inc(); gt(inc(), 2)", "true"));
+  assert(ev(js2, "inc()", "1"));  // Clones are isolated
+  assert(ev(tmpl, "n", "0"));
+  assert(js_reset_to(js, tmpl));  // Start over
+  assert(ev(js, "inc()", "1"));
+  assert(js_clone(tmpl, mem2, sizeof(*tmpl) + 8) == NULL);  // Too small
+  assert(js_clone(tmpl, mem, sizeof(mem)) == NULL);         // Itself
+  assert(js_create(mem3, sizeof(*tmpl) + 64) != NULL);
+  assert(!js_reset_to((struct js *) mem3, tmpl));
+}
+
+static void test_rope(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000], buf[410];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let s = '', i = 0;", "undefined"));
+  assert(ev(js, "for (i = 0; i < 100; i++) s += 'abcd'; s.length", "400"));
+  assert(ev(js, "for (i = 0; i < 130; i++) s += 'ef' + 'g'; s.length", "790"));
+  assert(ev(js, "let u = s + 'x'; u === s + 'x'", "true"));
+  assert(ev(js, "let t = s; t += '!'; t === s", "false"));
+  assert(ev(js, "t.length", "791"));
+  jsval_t v = js_eval(js, "s", ~0U);
+  size_t n;
+  char *p = js_getstr(js, v, &n);
+  assert(p != NULL && n == 790);
+  assert(memcmp(p, "abcdabcd", 8) == 0);
+  assert(memcmp(p + 396, "abcdefgefg", 10) == 0);
+  assert(strcmp(p + 784, "efgefg") == 0);
+  js_gc(js);
+  assert(ev(js, "t.length", "791"));
+  buf[0] = '"';
+  for (int i = 0; i < 100; i++) memcpy(buf + 1 + i * 4, "abcd", 4);
+  memcpy(buf + 401, "\"", 2);
+  assert(ev(js, "s = ''; for (i = 0; i < 100; i++) s += 'abcd'; s", buf));
+}
+
+static void test_shortstr(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 1500], *p;
+  const char *code = "c = a + b; c = c + 'x'; c === 'onidx'";
+  size_t n;
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let a = 'on', b = 'id', c;", "undefined"));
+  assert(js_eval(js, code, strlen(code)) == js_mktrue());
+  jsoff_t brk = js->brk;
+  assert(js_eval(js, code, strlen(code)) == js_mktrue());
+  jsval_t v = js_mkstr(js, "hello", 5);
+  assert(js->brk == brk || !JS_SHORTSTR);  // Short strings take no memory
+  assert((p = js_getstr(js, v, &n)) != NULL);
+  assert(n == 5 && strcmp(p, "hello") == 0);
+  js_set(js, js_glob(js), "s", v);
+  assert(ev(js, "s.length", "5"));
+  assert(ev(js, "s + ', world'", "\"hello, world\""));
+  assert(ev(js, "s === 'hello' ? '' : 'no'", "\"\""));
+  assert(ev(js, "let o = {'k': 'v', 'key': s}; o.k + o.key", "\"vhello\""));
+  js_gc(js);
+  assert(ev(js, "a + b + o.k", "\"onidv\""));
+  assert(ev(js, "typeof o.k", "\"string\""));
+}
+
+#if JS_DTOA
+static void test_dtoa(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 500];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "0", "0"));
+  assert(ev(js, "0 - 42", "-42"));
+  assert(ev(js, "9007199254740991", "9007199254740991"));
+  assert(ev(js, "1 / 3", "0.3333333333333333"));
+  assert(ev(js, "0.1 * 3", "0.30000000000000004"));
+  assert(ev(js, "2.5e-7", "2.5e-7"));
+  assert(ev(js, "0.0000025", "0.0000025"));
+  assert(ev(js, "123e18", "123000000000000000000"));
+  assert(ev(js, "123e19", "1.23e+21"));
+  assert(ev(js, "1.7976931348623157e308", "1.7976931348623157e+308"));
+  assert(ev(js, "5e-324", "5e-324"));
+  char buf[32];
+  for (double d = 1e-30; d < 1e30; d *= 7.3) {
+    buf[fmtnum(d, buf)] = '\0';
+    assert(strtod(buf, NULL) == d);  // Round trip
+  }
+}
+#endif
+
+#if JS_ARRAY
+static void test_array(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let a = [1, 'x', {b: 2}, [3]]; a", "[1,\"x\",{\"b\":2},[3]]"));
+  assert(ev(js, "typeof a", "\"object\""));
+  assert(ev(js, "a.length", "4"));
+  assert(ev(js, "a[0] + a[2].b + a[3][0]", "6"));
+  assert(ev(js, "a[4]", "undefined"));
+  assert(ev(js, "a[1.5]", "undefined"));
+  assert(ev(js, "a[-1]", "undefined"));
+  assert(ev(js, "a[1e20]", "undefined"));
+  assert(ev(js, "a[4294967296]", "undefined"));
+  assert(ev(js, "a['0']", "ERROR: bad index"));
+  assert(ev(js, "a[0] = 7; a[0] += 3; a[0]++; a[0]", "11"));
+  assert(ev(js, "a[4] = 1", "ERROR: bad lhs"));
+  assert(ev(js, "a.foo()", "ERROR: no method foo"));
+  assert(ev(js, "[]", "[]"));
+  assert(ev(js, "let b = []; b.push(1, 2)", "2"));
+  assert(ev(js, "let i = 0; for (i = 0; i < 100; i++) b.push(i * 2); b.length",
+            "102"));
+  assert(ev(js, "b[101] + b[2]", "198"));
+  assert(ev(js, "b.pop() + b.pop()", "394"));
+  assert(ev(js, "b.length", "100"));
+  assert(ev(js, "let f = function(x) { return x[1]; }; f(b)", "2"));
+  assert(ev(js, "a[3].push('s' + 'tr'); a[3]", "[3,\"str\"]"));
+  assert(ev(js, "a = 0; let c = [[], 'zz'];", "undefined"));
+  js_gc(js);
+  assert(ev(js, "c[0].push(c[1] + '!'); c", "[[\"zz!\"],\"zz\"]"));
+  assert(ev(js, "b[99]", "194"));
+  assert(ev(js, "[1] ? 1 : 2", "1"));
+  assert(ev(js, "let d = [], g = 0;", "undefined"));
+  for (int i = 0; i < 50; i++) {  // Grow an old array, let GC move things
+    js_eval(js, "d.push({k: d.length, s: 'abcdefgh' + 'ij'}); g = {};", ~0U);
+  }
+  assert(ev(js, "d.length + d[49].k + d[0].k", "99"));
+  assert(ev(js, "d[49].s + d[0].s", "\"abcdefghijabcdefghij\""));
+}
+
+// GC triggered while array elements, indices, assigned values or rhs operands
+// are evaluated, must not move arrays under construction, lvalues or lhs values
+static void test_array_gc(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 3000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let junk = function(n) { let s = ''; "
+                "for (let i = 0; i < n; i++) { s = s + 'abcdefgh'; } "
+                "return 7; }; 0",
+            "0"));
+  assert(ev(js, "let a = [1]; let p1 = {a: 1}; a.push(junk(40)); a", "[1,7]"));
+  assert(ev(js, "let b = [junk(40), junk(40)]; b", "[7,7]"));
+  assert(ev(js, "let c = [1, [2, 3]]; let p2 = {}; c[junk(40) - 6]", "[2,3]"));
+  assert(ev(js, "c[1][junk(40) - 7]", "2"));
+  assert(ev(js, "let d = [1]; let p3 = {}; d[0] = junk(40); d", "[7]"));
+  assert(ev(js, "c[1][1] += junk(40); c[1]", "[2,10]"));
+  assert(ev(js, "let o = {a: junk(40), b: junk(40)}; o.a + o.b", "14"));
+  assert(ev(js, "let k = {v: 0}; let p4 = {}; k.v = junk(40); k.v", "7"));
+  assert(ev(js, "let z = function() { junk(40); return 'Z'; }; "
+                "let t = 'abcdefghijklmnopqrstuvwxyz'; (t + 'q') + z()",
+            "\"abcdefghijklmnopqrstuvwxyzqZ\""));
+}
+#endif
+
+#if JS_TYPED
+static void test_typed(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 1000];
+  uint8_t u8[] = {1, 2, 3, 250};
+  int16_t i16[] = {-300, 7};
+  float f32[] = {0.5f, 2.0f};
+  size_t len = 0;
+  int type = -1;
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsval_t v = js_mktyped(js, u8, sizeof(u8), JS_UINT8);
+  assert(js_type(v) == JS_PRIV);
+  js_set(js, js_glob(js), "b", v);
+  js_set(js, js_glob(js), "w", js_mktyped(js, i16, 2, JS_INT16));
+  js_set(js, js_glob(js), "f", js_mktyped(js, f32, 2, JS_FLOAT32));
+  js_set(js, js_glob(js), "d", js_mktyped(js, NULL, 3, JS_FLOAT64));
+  assert(js_type(js_mktyped(js, NULL, 1, 42)) == JS_ERR);
+  assert(ev(js, "b", "[1,2,3,250]"));
+  assert(ev(js, "typeof b", "\"object\""));
+  assert(ev(js, "let s = 0, i = 0; for (i = 0; i < b.length; i++) s += b[i]; s",
+            "256"));
+  assert(ev(js, "b[0] = 257; b[1] += 3; b[2]++; b[4]", "undefined"));
+  assert(ev(js, "b[-1]", "undefined"));
+  assert(ev(js, "b[1e20]", "undefined"));
+  assert(u8[0] == 1 && u8[1] == 5 && u8[2] == 4);  // Written in place
+  u8[3] = 9;
+  assert(ev(js, "b[3]", "9"));
+  assert(ev(js, "w[0] + w[1]", "-293"));
+  assert(ev(js, "w[1] = 0 - 40000; w[1]", "25536"));
+  assert(ev(js, "b[1] = 1e30; b[2] = -1e30; b[1] + b[2]", "0"));
+  assert(ev(js, "b[0] = 4294967297; w[0] = -4294967297; b[0] + w[0]", "0"));
+  assert(ev(js, "b[0] = -1.9; w[0] = 65535.9; b[0] + w[0]", "254"));
+  assert(ev(js, "f[0] = f[0] + f[1] + 0.25; f", "[2.75,2]"));
+  assert(f32[0] == 2.75f);
+  assert(touint32((double) NAN) == 0 && touint32((double) INFINITY) == 0);
+  assert(touint32(-(double) INFINITY) == 0 && touint32(-1.5) == 4294967295U);
+  assert(touint32(1e30) == 0 && touint32(-1e30) == 0);
+  assert(touint32(4294967301.7) == 5);
+  assert(touint32(-4294967301.7) == 4294967291U);
+  assert(ev(js, "b[0] = 'x'", "ERROR: type mismatch"));
+  assert(ev(js, "b.x", "ERROR: lookup in non-obj"));
+  assert(ev(js, "d[1] = 0.1; d", "[0,0.1,0]"));
+  js_gc(js);
+  assert(ev(js, "d[1] + d[2]", "0.1"));
+  double d1 = 0;
+  char *p = (char *) js_gettyped(js, js_eval(js, "d", ~0U), &len, &type);
+  assert(p != NULL && len == 3 && type == JS_FLOAT64);
+  memcpy(&d1, p + sizeof(d1), sizeof(d1));  // JS memory may be unaligned
+  assert(d1 == 0.1);
+}
+#endif
+
+#if JS_EXTSTR
+static int s_freed;
+static void extfree(void *p) {
+  s_freed++;
+  free(p);
+}
+
+static void test_extstr(void) {
+  struct js *js, *js2;
+  char mem[sizeof(*js) + 2000], mem2[sizeof(mem)], *p = (char *) malloc(100);
+  size_t n;
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  memset(p, 'a', 100);
+  memcpy(p, "hello", 5);
+  jsoff_t brk = js->brk;
+  jsval_t v = js_mkstr_ext(js, p, 100, extfree);
+  assert(js->brk - brk == 20);  // Only the entity, not the bytes
+  assert(js_type(v) == JS_STR && js_getstr(js, v, &n) == p && n == 100);
+  js_set(js, js_glob(js), "m", v);
+  js_set(js, js_glob(js), "h", js_mkstr_ext(js, "hello", 5, NULL));
+  assert(ev(js, "typeof m", "\"string\""));
+  assert(ev(js, "m.length", "100"));
+  assert(ev(js, "h === 'hello'", "true"));
+  assert(ev(js, "h + ', world'", "\"hello, world\""));
+  assert(ev(js, "let c = m + '!'; c.length", "101"));
+  assert(ev(js, "let d = h + m; d.length", "105"));
+  assert(ev(js, "m === c", "false"));
+  assert(ev(js, "let e = c + m; e.length", "201"));
+  js_gc(js);
+  assert(s_freed == 0 && ev(js, "h + m === d", "true"));
+  assert(js_clone(js, mem2, sizeof(mem2)) != NULL);
+  js2 = (struct js *) mem2;
+  assert(ev(js2, "m = 0", "0"));
+  js_gc(js2);
+  assert(s_freed == 0);  // Clone does not own external strings
+  assert(ev(js, "m = 0", "0"));
+  js_gc(js);
+  assert(s_freed == 1);
+  assert(ev(js, "c.length + h.length", "106"));
+  char *q = js_getstr(js, js_eval(js, "c", ~0U), &n);
+  assert(n == 101 && memcmp(q, "helloaaa", 8) == 0 && q[100] == '!');
+}
+#endif
+
+#if JS_CODEREGS
+static void test_coderegs(void) {
+  struct js *js, *js2;
+  char mem[sizeof(*js) + 8000], mem2[sizeof(mem)];
+  static const char code[] =
+      "let f = function(a) { let g = function(x) { return x * 2; }; "
+      "return g(a) + 1; };";
+  static const char loop[] = "let s = 0, i = 0; "
+                             "for (i = 0; i < 10; i++) s += f(i); s";
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert((js2 = js_create(mem2, sizeof(mem2))) != NULL);
+  assert(js_addcode(js, code, strlen(code)));
+  assert(js_addcode(js, code, strlen(code)));  // Same region again
+  assert(js_addcode(js, loop, strlen(loop)));
+  assert(ev(js, code, "undefined"));
+  assert(ev(js2, code, "undefined"));
+  assert(ev(js, "f(1)", "3"));
+  assert(ev(js2, "f(1)", "3"));
+  jsoff_t brk = js->brk, brk2 = js2->brk;
+  assert(ev(js, "f(1)", "3"));
+  assert(ev(js2, "f(1)", "3"));
+  assert(js->brk - brk + 20 < js2->brk - brk2);  // g source is not copied
+  assert(ev(js, loop, "100"));
+  assert(ev(js, "typeof f", "\"function\""));
+  assert(ev(js, "f(3)", "7"));
+  jsval_t v = js_eval(js, "f", ~0U);
+  assert(strncmp(js_str(js, v), "function(a) { let g =", 21) == 0);
+
+  // A clone shares regions with the template. A restored snapshot gets them
+  // unbound, until they are registered again, in the same order
+  assert((js2 = js_clone(js, mem2, sizeof(mem2))) != NULL);
+  assert(ev(js2, "f(3)", "7"));
+  assert(js_snapshot(js, mem2, sizeof(mem2)) <= sizeof(mem2));
+  assert((js2 = js_restore(mem2, sizeof(mem2))) != NULL);
+  assert(ev(js2, "f(3)", "ERROR: code region not bound"));
+  assert(ev(js2, "1 + 2", "3"));
+  char code2[sizeof(code)], loop2[sizeof(loop)];  // Same code, new addresses
+  memcpy(code2, code, sizeof(code)), memcpy(loop2, loop, sizeof(loop));
+  assert(!js_addcode(js2, loop2, strlen(loop2)));  // Region 0 holds `code`
+  assert(js_addcode(js2, code2, strlen(code2)));
+  assert(js_addcode(js2, loop2, strlen(loop2)));
+  assert(ev(js2, "f(3)", "7"));
+  assert(js_addcode(js, mem, 1));
+  assert(js_addcode(js, "x", 1));
+  assert(!js_addcode(js, "y", 1));  // Table is full
+}
+#endif
+
+static void test_delete(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 3000], buf[20];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsval_t obj = js_mkobj(js);
+  js_set(js, js_glob(js), "o", obj);
+  js_set(js, obj, "a", js_mknum(1));
+  jsoff_t brk = js->brk;
+  for (int i = 0; i < 100; i++) js_set(js, obj, "a", js_mknum(i));
+  assert(js->brk == brk);  // Updated in place
+  js_set(js, obj, "b", js_mkstr(js, "hello!", 6));
+  assert(ev(js, "o", "{\"b\":\"hello!\",\"a\":99}"));
+  assert(ev(js, "delete o.a", "true"));
+  assert(ev(js, "o", "{\"b\":\"hello!\"}"));
+  assert(ev(js, "delete o.a", "true"));
+  assert(ev(js, "o.a", "undefined"));
+  assert(ev(js, "o.a = 2", "ERROR: bad lhs"));
+  assert(ev(js, "let x = 1; delete x", "false"));
+  assert(ev(js, "delete 1", "false"));
+  assert(ev(js, "delete o.c.d", "ERROR: lookup in non-obj"));
+  assert(ev(js, "let p = {x: {y: 1, z: 2}}; delete p.x.y; p", "{\"x\":{\"z\":2}}"));
+  assert(ev(js, "delete p.x; p", "{}"));
+  assert(ev(js, "let q = {delete: 1, b: 2}; q.delete", "1"));  // Still a key
+  assert(ev(js, "delete q.delete; q", "{\"b\":2}"));
+  assert(ev(js, "false ? delete o.b : 1; o.b", "\"hello!\""));
+  js_gc(js);
+  brk = js->brk;
+  assert(ev(js, "delete o.b; o", "{}"));
+  js_gc(js);
+  assert(js->brk < brk);  // Property and its string are collected
+  for (int i = 0; i < 30; i++) {  // Indexed object
+    snprintf(buf, sizeof(buf), "k%d", i);
+    js_set(js, obj, buf, js_mknum(i));
+  }
+  assert(ev(js, "delete o.k0; delete o.k29; delete o.k10; o.k1 + o.k28", "29"));
+  assert(ev(js, "typeof o.k0 === typeof o.k10", "true"));
+  assert(ev(js, "typeof o.k10", "\"undefined\""));
+  js_gc(js);
+  assert(ev(js, "o.k2 + o.k27", "29"));
+}
+
+static void test_get(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000], buf[20];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsval_t cfg = js_eval(js, "let c = {temp: 21.5, name: 'kitchen', on: true,"
+                            " sub: {x: 1}}; c", ~0U);
+  assert(js_type(js_get(js, cfg, "temp")) == JS_NUM);
+  assert(js_getnum(js_get(js, cfg, "temp")) == 21.5);
+  assert(strcmp(js_str(js, js_get(js, cfg, "sub")), "{\"x\":1}") == 0);
+  assert(js_type(js_get(js, cfg, "nope")) == JS_UNDEF);
+  assert(js_type(js_get(js, js_mknum(1), "temp")) == JS_UNDEF);
+
+  double temp = 0;
+  char *name = NULL;
+  bool on = false, missing = false;
+  jsval_t sub = js_mkundef();
+  assert(js_unpack(js, cfg, "temp:d,name:s,on:b,sub:j", &temp, &name, &on,
+                   &sub) == 4);
+  assert(temp == 21.5 && strcmp(name, "kitchen") == 0 && on == true);
+  assert(strcmp(js_str(js, sub), "{\"x\":1}") == 0);
+  temp = 0;
+  assert(js_unpack(js, cfg, "name:d,temp:d,x:b", &temp, &temp, &missing) == 1);
+  assert(temp == 21.5 && missing == false);  // Mismatched and missing skipped
+  assert(js_unpack(js, cfg, "", NULL) == 0);
+  assert(js_unpack(js, cfg, "temp", &temp) == -1);
+  assert(js_unpack(js, cfg, "temp:dd", &temp) == -1);
+  assert(js_unpack(js, cfg, "temp:x", &temp) == -1);
+  assert(js_unpack(js, js_mknull(), "temp:d", &temp) == 0);
+
+  size_t pos = 0, n = 0;
+  jsval_t k, v;
+  while (js_next(js, cfg, &pos, &k, &v)) {
+    const char *s = js_getstr(js, k, NULL);
+    assert(s != NULL && js_type(v) != JS_UNDEF);
+    if (strncmp(s, "temp", 4) == 0) assert(js_getnum(v) == 21.5);
+    n++;
+  }
+  assert(n == 4);
+  assert(js_next(js, js_mkobj(js), &pos, &k, &v) == false);
+  pos = 0;
+  assert(js_next(js, js_mknum(1), &pos, &k, &v) == false);
+
+  jsval_t obj = js_mkobj(js);  // Large object, with property index
+  for (int i = 0; i < 30; i++) {
+    snprintf(buf, sizeof(buf), "k%d", i);
+    js_set(js, obj, buf, js_mknum(i));
+  }
+  double sum = 0, k7 = 0;
+  assert(js_getnum(js_get(js, obj, "k0")) == 0);  // Builds index
+  jsoff_t brk = js->brk;
+  for (pos = 0, n = 0; js_next(js, obj, &pos, NULL, &v); n++) {
+    sum += js_getnum(v);
+  }
+  assert(n == 30 && sum == 435);
+  assert(js_unpack(js, obj, "k7:d,k0:d", &k7, &sum) == 2);
+  assert(k7 == 7 && sum == 0);
+  assert(js->brk == brk);  // No allocations
+  char *id = NULL;
+  js_set(js, obj, "id", js_mkstr(js, "k30", 3));
+  brk = js->brk;
+  assert(js_unpack(js, obj, "id:s", &id) == 1 && strcmp(id, "k30") == 0);
+  assert(JS_SHORTSTR ? js->brk > brk : js->brk == brk);  // Copied if short
+
+#if JS_ARRAY
+  jsval_t arr = js_eval(js, "[1, 'a', 3]", ~0U);
+  for (pos = 0, n = 0; js_next(js, arr, &pos, &k, &v); n++) {
+    assert(js_getnum(k) == (double) n);
+  }
+  assert(n == 3 && strcmp(js_str(js, v), "3") == 0);
+#endif
+#if JS_MAP
+  jsval_t m = js_eval(js, "let m = new Map(); m.set('a', 1); m.set(2, 'b'); m",
+                      ~0U);
+  for (pos = 0, n = 0; js_next(js, m, &pos, &k, &v); n++) {
+    assert(js_type(k) == JS_STR ? js_getnum(v) == 1 : js_type(v) == JS_STR);
+  }
+  assert(n == 2);
+  m = js_eval(js, "let s = new Set(); s.add(5); s.add(5); s", ~0U);
+  for (pos = 0, n = 0; js_next(js, m, &pos, &k, &v); n++) {
+    assert(js_getnum(k) == 5 && js_getnum(v) == 5);
+  }
+  assert(n == 1);
+#endif
+}
+
+static jsval_t js_apply(struct js *js, jsval_t *args, int nargs) {
+  if (nargs < 1) return js_mkerr(js, "no func");
+  return js_call(js, args[0], args + 1, nargs - 1);
+}
+
+static void test_call(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsval_t f = js_eval(js, "let f = function(a, b) { return a * b; }; f", ~0U);
+  jsval_t args[] = {js_mknum(6), js_mknum(7), js_mknum(8)};
+  assert(strcmp(js_str(js, js_call(js, f, args, 2)), "42") == 0);
+  assert(strcmp(js_str(js, js_call(js, f, args, 3)), "42") == 0);
+  assert(strcmp(js_str(js, js_call(js, f, args, 1)),
+                "ERROR: type mismatch") == 0);  // b is undefined
+  assert(strcmp(js_str(js, js_call(js, f, NULL, 0)), "ERROR: type mismatch") ==
+         0);
+  assert(strcmp(js_str(js, js_call(js, f, NULL, 1)), "ERROR: bad args") == 0);
+  assert(strcmp(js_str(js, js_call(js, js_mknum(1), args, 1)),
+                "ERROR: calling non-function") == 0);
+
+  jsval_t g = js_eval(js, "let g = function(s) { let x = s + '!'; }; g", ~0U);
+  args[0] = js_mkstr(js, "hi", 2);
+  assert(js_type(js_call(js, g, args, 1)) == JS_UNDEF);  // No return
+  g = js_eval(js, "let h = function(s) { return typeof s; }; h", ~0U);
+  assert(strcmp(js_str(js, js_call(js, g, args, 1)), "\"string\"") == 0);
+  assert(strcmp(js_str(js, js_call(js, g, NULL, 0)), "\"undefined\"") == 0);
+
+  jsval_t gt = js_mkfun(js_gt);  // C functions get arguments as is
+  args[0] = js_mknum(2), args[1] = js_mknum(1);
+  assert(js_type(js_call(js, gt, args, 2)) == JS_TRUE);
+  assert(js_type(js_call(js, gt, args, 1)) == JS_ERR);
+
+  // C function that calls back into JS, from the middle of an expression
+  js_set(js, js_glob(js), "apply", js_mkfun(js_apply));
+  assert(ev(js, "1 + apply(f, 2, 3) + apply(f, apply(f, 2, 2), 10)", "47"));
+  assert(ev(js, "let r = 0; for (let i = 0; i < 3; i++) r += apply(f, i, i); r",
+            "5"));
+
+  f = js_eval(js, "let n = 0; let inc = function(d) { n += d; return n; }; inc",
+              ~0U);
+  jsoff_t brk = js->brk;
+  for (int i = 0; i < 300; i++) {  // Calls do not leak memory
+    args[0] = js_mknum(1);
+    assert(js_type(js_call(js, f, args, 1)) == JS_NUM);
+    js_gc(js);
+    f = js_get(js, js_glob(js), "inc");  // GC may move the function
+  }
+  assert(js->brk <= brk + 64);
+  assert(ev(js, "n", "300"));
+}
+
+static jsval_t js_gcnow(struct js *js, jsval_t *args, int nargs) {
+  js_gc(js);  // Compact memory in the middle of an argument list
+  return nargs > 0 ? args[0] : js_mkundef();
+}
+
+static jsval_t js_nargs(struct js *js, jsval_t *args, int nargs) {
+  (void) js, (void) args;
+  return js_mknum(nargs);
+}
+
+static void test_call_args(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 8000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  js_set(js, js_glob(js), "gc", js_mkfun(js_gcnow));
+  js_set(js, js_glob(js), "nargs", js_mkfun(js_nargs));
+
+  // Arguments are evaluated in the caller's scope, not the callee's
+  assert(ev(js, "let a = 5; let f = function(a, b) { return b; }; f(1, a)",
+            "5"));
+  assert(ev(js, "let g = function(x) { return f(x + 1, x * 2); }; g(a)", "10"));
+  assert(ev(js, "let i = 0; f(i++, i++) + i", "3"));
+  assert(ev(js, "f(1, 2, 3)", "2"));
+  assert(ev(js, "f(1)", "undefined"));
+  assert(ev(js, "f(1, x)", "ERROR: 'x' not found"));
+  assert(ev(js, "f(f(x, 1), 2)", "ERROR: 'x' not found"));
+  assert(ev(js, "f(1, 2", "ERROR: parse error"));
+  assert(ev(js, "nargs()", "0"));
+  assert(ev(js, "nargs(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12)", "12"));
+  assert(ev(js, "true && f(1, 2)", "2"));
+  assert(ev(js, "false && f(1, y)", "false"));  // Skipped, not evaluated
+
+  // Arguments and the function survive GC done by the following arguments
+  assert(ev(js, "(function(p, q, r) { return p + q + r.s; })"
+                "('a' + 'b', gc('c' + 'd'), gc({s: 'e' + 'f'}))",
+            "\"abcdef\""));
+  assert(ev(js, "f(gc('x' + 'y'), gc('z' + '!'))", "\"z!\""));
+  assert(js->argf == 0);
+
+  // The lhs of a binary operator survives GC done by the rhs
+  assert(ev(js, "let s = 'abcdefghijklmnopqrstuvwxyz'; "
+                "let z = function() { gc(); return 'Z'; }; (s + 'q') + z()",
+            "\"abcdefghijklmnopqrstuvwxyzqZ\""));
+  assert(ev(js, "(s + 'q') === z() + 'q'", "false"));
+  assert(ev(js, "s + (s + z()) === s + s + 'Z'", "true"));
+  assert(js->argf == 0);
+
+  // Recursion. GC moves function bodies that are being executed
+  assert(ev(js, "let fib = function(n) { if (n < 2) return n; "
+                "return fib(n - 1) + fib(n - 2); }; fib(12)",
+            "144"));
+  assert(js->argf == 0);
+
+  // GC in a call keeps the caller's "GC disabled" nogc as is
+  assert(ev(js, "let junk = 'x' + 'y' + 'z' + 'abcdefgh'; "
+                "let h = function() { return gc(1); }; 0",
+            "0"));
+  assert(ev(js, "junk = 0; 1", "1"));
+  js->nogc = (jsoff_t) ~0;
+  assert(ev(js, "h()", "1"));
+  assert(js->nogc == (jsoff_t) ~0);
+  js->nogc = 0;
+}
+
+// Recursion on a small heap. A JS call releases its argument frame before
+// the body runs, so a call level costs a scope and its parameters only
+static void test_call_depth(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 800];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let g = function(n) { return n ? g(n - 1) : 0; }; g(20)",
+            "0"));
+  assert(ev(js, "g(100)", "ERROR: oom"));  // Not a parse error
+  assert(js->argf == 0 && js->cf == NULL);
+  assert(ev(js, "g(20)", "0"));
+  assert(ev(js, "let fib = function(n) { return n < 2 ? n : "
+                "fib(n - 1) + fib(n - 2); }; fib(15)",
+            "610"));
+  assert(js->argf == 0 && js->cf == NULL);
+}
+
+#if JS_PINS
+static int s_cb = -1;  // Pinned callback
+static jsval_t js_on(struct js *js, jsval_t *args, int nargs) {
+  if (nargs != 1) return js_mkerr(js, "1 cb expected");
+  js_unpin(js, s_cb);
+  s_cb = js_pin(js, args[0]);
+  return js_mkundef();
+}
+
+static void test_pins(void) {
+  struct js *js, *js2;
+  char mem[sizeof(*js) + 8000], mem2[sizeof(mem)];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(js_type(js_pinned(js, 0)) == JS_UNDEF);
+  assert(js_type(js_pinned(js, -1)) == JS_UNDEF);
+  js_unpin(js, 5);  // No table, nothing to do
+  js_mkstr(js, NULL, 100);  // Garbage, makes GC move what goes next
+  jsval_t obj = js_mkobj(js);
+  js_set(js, obj, "a", js_mkstr(js, "hello", 5));
+  int h = js_pin(js, obj), h2 = js_pin(js, js_mknum(3));
+  assert(h == 0 && h2 == 1);
+  js_gc(js);
+  assert(js_pinned(js, h) != obj);  // Moved
+  assert(strcmp(js_str(js, js_pinned(js, h)), "{\"a\":\"hello\"}") == 0);
+  assert(js_getnum(js_pinned(js, h2)) == 3);
+
+  // JS code passes a callback, C code calls it later
+  js_set(js, js_glob(js), "on", js_mkfun(js_on));
+  assert(ev(js, "let n = 0; on(function(x) { n += x; return n; });",
+            "undefined"));
+  jsval_t arg = js_mknum(2);
+  assert(ev(js, "let s = 'xy';", "undefined"));
+  for (int i = 0; i < 50; i++) {
+    assert(ev(js, "s = 'xy' + s + s + s; s = 'xy';", "\"xy\""));  // Garbage
+    if (i % 10 == 0) js_gc(js);
+    assert(js_getnum(js_call(js, js_pinned(js, s_cb), &arg, 1)) == 2 * i + 2);
+  }
+  assert(ev(js, "on(function(x) { return x + 1; }); n", "100"));
+  js_gc(js);  // First callback is unpinned and collected
+  assert(js_getnum(js_call(js, js_pinned(js, s_cb), &arg, 1)) == 3);
+
+  js_unpin(js, h);
+  assert(js_type(js_pinned(js, h)) == JS_UNDEF);
+  jsoff_t brk = js->brk;
+  js_gc(js);
+  assert(js->brk < brk);  // Object and its string are collected
+  for (int i = 0; i < 20; i++) {  // Grow the table, reusing a free slot first
+    assert(js_pin(js, js_mkstr(js, "abcdefgh", (size_t) i % 8 + 1)) ==
+           (i == 0 ? h : i + 2));
+  }
+  js_gc(js);
+  for (int i = 1; i < 20; i++) {
+    size_t len = 0;
+    char *s = js_getstr(js, js_pinned(js, i + 2), &len);
+    assert(s != NULL && len == (size_t) i % 8 + 1 && memcmp(s, "abc", 1) == 0);
+  }
+
+  assert((js2 = js_clone(js, mem2, sizeof(mem2))) != NULL);  // Pins are copied
+  assert(js_getnum(js_pinned(js2, h2)) == 3);
+  assert(js_getnum(js_call(js2, js_pinned(js2, s_cb), &arg, 1)) == 3);
+  js_unpin(js, s_cb);
+  s_cb = -1;
+}
+#endif
+
+static jsarg_t tf_add(struct js *js, jsarg_t *args) {
+  jsarg_t r;
+  r.d = args[0].d + args[1].d;
+  (void) js;
+  return r;
+}
+
+static jsarg_t tf_gpio(struct js *js, jsarg_t *args) {
+  jsarg_t r;
+  r.b = args[0].i == 13 && args[1].b;
+  (void) js;
+  return r;
+}
+
+static jsarg_t tf_len(struct js *js, jsarg_t *args) {
+  jsarg_t r;
+  r.i = (int) args[0].s.len;
+  (void) js;
+  return r;
+}
+
+static jsarg_t tf_tail(struct js *js, jsarg_t *args) {
+  jsarg_t r;
+  size_t n = (size_t) args[1].i;
+  r.s.ptr = args[0].s.ptr + (n < args[0].s.len ? n : args[0].s.len);
+  r.s.len = args[0].s.len - (size_t) (r.s.ptr - args[0].s.ptr);
+  (void) js;
+  return r;
+}
+
+static jsarg_t tf_id(struct js *js, jsarg_t *args) {
+  jsarg_t r;
+  r.j = js_mkobj(js);
+  js_set(js, r.j, "v", args[0].j);
+  return r;
+}
+
+static void test_typed_funcs(void) {
+  static const struct jsfun add = {tf_add, "dd>d"}, gpio = {tf_gpio, "ib>b"},
+                            len = {tf_len, "s>i"}, tail = {tf_tail, "si>s"},
+                            id = {tf_id, "j>j"}, nop = {tf_id, ">v"},
+                            bad1 = {tf_id, "x>d"}, bad2 = {tf_id, "dd"},
+                            bad3 = {tf_id, "d>dd"}, bad4 = {tf_id, "d>x"},
+                            bad5 = {tf_id, "ddddddddd>v"};
+  struct js *js;
+  char mem[sizeof(*js) + 3000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  jsval_t glob = js_glob(js);
+  js_set(js, glob, "add", js_mkfun_typed(js, &add));
+  js_set(js, glob, "gpio", js_mkfun_typed(js, &gpio));
+  js_set(js, glob, "len", js_mkfun_typed(js, &len));
+  js_set(js, glob, "tail", js_mkfun_typed(js, &tail));
+  js_set(js, glob, "id", js_mkfun_typed(js, &id));
+  js_set(js, glob, "nop", js_mkfun_typed(js, &nop));
+  assert(ev(js, "add(1, 2.5)", "3.5"));
+  assert(ev(js, "add(add(1, 2), 3 * 4) + 1", "16"));
+  assert(ev(js, "add(1)", "ERROR: bad arg 2"));
+  assert(ev(js, "add(1, 'x')", "ERROR: bad arg 2"));
+  assert(ev(js, "add(1, 2, 3)", "ERROR: 2 args expected"));
+  assert(ev(js, "add(1, x)", "ERROR: 'x' not found"));
+  assert(ev(js, "gpio(13, true)", "true"));
+  assert(ev(js, "gpio(13.7, true)", "true"));
+  assert(ev(js, "gpio(12, true) || gpio(13, false)", "false"));
+  assert(ev(js, "gpio(1e10, true)", "ERROR: bad arg 1"));
+  assert(ev(js, "gpio(true, 13)", "ERROR: bad arg 1"));
+  assert(ev(js, "len('') + len('hi') + len('a long string!')", "16"));
+  assert(ev(js, "let s = 'ab'; s += 'cdefgh'; tail(s, 5)", "\"fgh\""));
+  assert(ev(js, "tail('xyz', 7)", "\"\""));
+  assert(ev(js, "id(null)", "{\"v\":null}"));
+  assert(ev(js, "id('x').v", "\"x\""));
+  assert(ev(js, "nop()", "undefined"));
+  assert(ev(js, "typeof add", "\"cfunc\""));
+  assert(ev(js, "add(1, 2, 3, 4, 5, 6, 7, 8, 9, 10)",
+            "ERROR: 2 args expected"));
+  assert(js_type(js_mkfun_typed(js, &bad1)) == JS_ERR);
+  assert(js_type(js_mkfun_typed(js, &bad2)) == JS_ERR);
+  assert(js_type(js_mkfun_typed(js, &bad3)) == JS_ERR);
+  assert(js_type(js_mkfun_typed(js, &bad4)) == JS_ERR);
+  assert(js_type(js_mkfun_typed(js, &bad5)) == JS_ERR);
+
+  jsoff_t brk = js->brk, size = js->size;
+  assert(ev(js, "let k = 0; for (let i = 0; i < 100; i++) k = add(k, i); k",
+            "4950"));
+  assert(js->size == size && js->brk >= brk);
+  jsval_t args[] = {js_mknum(20), js_mknum(22)};  // Called from C
+  assert(js_getnum(js_call(js, js_mkfun_typed(js, &add), args, 2)) == 42);
+  assert(js_type(js_call(js, js_mkfun_typed(js, &add), args, 1)) == JS_ERR);
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+static double cpp_add(double a, double b) { return a + b; }
+static bool cpp_even(int n) { return n % 2 == 0; }
+static std::string cpp_greet(const std::string &name, unsigned n) {
+  return "hi " + name + std::string(n, '!');
+}
+static size_t cpp_len(std::string_view s) { return s.size(); }
+static void cpp_nop(void) {}
+static elk::value cpp_wrap(struct js *js, elk::value v) {
+  jsval_t obj = js_mkobj(js);
+  js_set(js, obj, "v", v);
+  return obj;
+}
+static const char *cpp_name(bool b) { return b ? "yes" : nullptr; }
+
+static void test_cpp(void) {
+  char mem[sizeof(struct js) + 3000];
+  elk::isolate js(mem, sizeof(mem)), js2(64);
+  assert(js && !js2);  // js2 is too small
+  js.def<cpp_add>("add");
+  js.def<cpp_even>("even");
+  js.def<cpp_greet>("greet");
+  js.def<cpp_len>("len");
+  js.def<cpp_nop>("nop");
+  js.def<cpp_wrap>("wrap");
+  js.def<cpp_name>("name");
+  assert(ev(js.get(), "add(1, 2.5)", "3.5"));
+  assert(ev(js.get(), "add(1)", "ERROR: 2 args expected"));
+  assert(ev(js.get(), "add(1, true)", "ERROR: bad arg 2"));
+  assert(ev(js.get(), "even(4) && !even(3)", "true"));
+  assert(ev(js.get(), "even(1e20)", "ERROR: bad arg 1"));
+  assert(ev(js.get(), "greet('bob', 2)", "\"hi bob!!\""));
+  assert(ev(js.get(), "greet('bob', -1)", "ERROR: bad arg 2"));
+  assert(ev(js.get(), "len('hello')", "5"));
+  assert(ev(js.get(), "nop()", "undefined"));
+  assert(ev(js.get(), "nop(1)", "ERROR: 0 args expected"));
+  assert(ev(js.get(), "wrap('x')", "{\"v\":\"x\"}"));
+  assert(ev(js.get(), "name(true) + name(false)", "ERROR: type mismatch"));
+  assert(ev(js.get(), "name(false)", "null"));
+
+  std::string s;
+  double d = 0;
+  jsval_t f = js.eval("let f = function(a, b) { return b + a; }; f");
+  assert(js.get(js.call(f, std::string("a"), std::string("b")), s));
+  assert(s == "ba");
+  assert(js.get(js.call(f, 1, 2.5), d) && d == 3.5);
+  assert(!js.get(js.call(f, 1, 2.5), s));
+  assert(js.get(js.call(elk::function<cpp_add>(), 2, 3), d) && d == 5);
+
+#if JS_PINS
+  elk::handle h = js.pin(f), h2;
+  assert(h && !h2);
+  js.eval("f = 0;");
+  js_gc(js.get());
+  h2 = std::move(h);  // Ownership moves, the value stays pinned
+  assert(!h && h2);
+  assert(js.get(js.call(h2.get(), 1, 2), d) && d == 3);
+  h2.reset();
+  assert(js_type(h2.get()) == JS_UNDEF);
+#endif
+  elk::isolate js3(std::move(js));
+  assert(js3 && !js);
+  assert(ev(js3.get(), "add(2, 2)", "4"));
+}
+#endif
+
+#if JS_MAP
+static void test_map(void) {
+  struct js *js;
+  char mem[sizeof(*js) + 16000];
+  assert((js = js_create(mem, sizeof(mem))) != NULL);
+  assert(ev(js, "let m = new Map(); m", "{}"));
+  assert(ev(js, "typeof m", "\"object\""));
+  assert(ev(js, "m.size", "0"));
+  assert(ev(js, "m.get('a')", "undefined"));
+  assert(ev(js, "m.set('a', 1).set(2, 'b').set('2', 3); m.size", "3"));
+  assert(ev(js, "m.get('a') + m.get('2')", "4"));
+  assert(ev(js, "m.get(2)", "\"b\""));
+  assert(ev(js, "m.set('a', 5); m.get('a')", "5"));
+  assert(ev(js, "m.set(-0, 1); m.has(0)", "true"));
+  assert(ev(js, "m.delete('a')", "true"));
+  assert(ev(js, "m.delete('a')", "false"));
+  assert(ev(js, "m.has('a') ? 1 : m.size", "3"));
+  assert(ev(js, "m.set({}, 1)", "ERROR: bad key"));
+  assert(ev(js, "m.foo(1)", "ERROR: no method foo"));
+  assert(ev(js, "m.add(1)", "ERROR: no method add"));
+  assert(ev(js, "m.clear(); m.size", "0"));
+  assert(ev(js, "let s = new Set(); s.add('x').add('x').add(1); s.size", "2"));
+  assert(ev(js, "s.has('x') && s.has(1) && !s.has('y')", "true"));
+  assert(ev(js, "s.get('x')", "ERROR: no method get"));
+  assert(ev(js, "new Foo()", "ERROR: no class Foo"));
+  assert(ev(js, "let f = function(x) { return x.delete(1); }; f(s)", "true"));
+  assert(ev(js, "s", "[\"x\"]"));
+  // Many elements: the table grows, deleted slots get reused
+  assert(ev(js, "let i = 0; for (i = 0; i < 100; i++) m.set(i, i * 2); "
+                "for (i = 0; i < 100; i += 2) m.delete(i); m.size", "50"));
+  assert(ev(js, "m.get(7) + m.get(99)", "212"));
+  assert(ev(js, "m.has(8) || m.has(100) || m.get(8)", "undefined"));
+  assert(ev(js, "for (i = 0; i < 100; i += 2) m.set(i, i); m.size", "100"));
+  assert(ev(js, "m.get(50) + m.get(51)", "152"));
+#if JS_ARRAY
+  assert(ev(js, "s.add(2); s.values().length", "2"));
+  assert(ev(js, "let k = new Map(); k.set('a', 1); k.keys()", "[\"a\"]"));
+  assert(ev(js, "k.values()", "[1]"));
+#endif
+  // GC moves keys and values of an old table
+  assert(ev(js, "let g = new Map(); g.set('key' + 'long1', 'value' + '1');",
+            "{\"keylong1\":\"value1\"}"));
+  for (int i = 0; i < 50; i++) {
+    js_eval(js, "g.set(g.size, {n: g.size}); i = {};", ~0U);
+  }
+  js_gc(js);
+  assert(ev(js, "g.get('keylong1')", "\"value1\""));
+  assert(ev(js, "g.get(50).n + g.size", "101"));
+  // GC triggered while method arguments are evaluated must not move the Map
+  char small[sizeof(*js) + 3000];
+  assert((js = js_create(small, sizeof(small))) != NULL);
+  assert(ev(js, "let junk = function(n) { let s = ''; "
+                "for (let i = 0; i < n; i++) { s = s + 'abcdefgh'; } "
+                "return 7; }; 0",
+            "0"));
+  assert(ev(js, "let p1 = {}; let m = new Map(); let p2 = {a: 1}; "
+                "m.set('x', junk(40)); m.get('x')",
+            "7"));
+  assert(ev(js, "let p3 = {}; m.has(junk(40)) || m.get(junk(40))",
+            "undefined"));
+  assert(ev(js, "m.set(junk(40), junk(40)).get(7) + m.size", "9"));
+  assert(ev(js, "let s = new Set(); let p4 = {}; s.add(junk(40)); s.has(7)",
+            "true"));
+}
+#endif
+
 int main(void) {
   clock_t a = clock();
   test_basic();
@@ -607,6 +1772,48 @@ int main(void) {
   test_c_funcs();
   test_ternary();
   test_gc();
+  test_gc_compact();
+  test_compile();
+  test_atoms();
+  test_index();
+  test_icache();
+  test_incgc();
+  test_nursery();
+  test_snapshot();
+  test_clone();
+  test_rope();
+  test_shortstr();
+#if JS_DTOA
+  test_dtoa();
+#endif
+#if JS_ARRAY
+  test_array();
+  test_array_gc();
+#endif
+#if JS_TYPED
+  test_typed();
+#endif
+#if JS_EXTSTR
+  test_extstr();
+#endif
+#if JS_CODEREGS
+  test_coderegs();
+#endif
+  test_delete();
+  test_get();
+  test_call();
+  test_call_args();
+  test_call_depth();
+  test_typed_funcs();
+#if JS_MAP
+  test_map();
+#endif
+#if JS_PINS
+  test_pins();
+#endif
+#if defined(__cplusplus) && __cplusplus >= 201703L
+  test_cpp();
+#endif
   double ms = (double) (clock() - a) * 1000 / CLOCKS_PER_SEC;
   printf("SUCCESS. All tests passed in %g ms\n", ms);
   return EXIT_SUCCESS;